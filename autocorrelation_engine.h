@@ -0,0 +1,469 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TBranch.h>
+#include <TLeaf.h>
+#include <TH1D.h>
+#include <TDirectory.h>
+#include <TROOT.h>
+#include <ROOT/TSeq.hxx>
+#include <ROOT/TThreadExecutor.hxx>
+
+#include "benchmark.h"
+
+namespace AutoCorrelationEngine
+{
+
+    struct ParameterResult
+    {
+        std::string name;
+        std::vector<double> autocorrelation; // Lags 0 -> max_lag
+        double integrated_time = 0;
+        double effective_sample_size = 0;
+        Long64_t n_samples = 0;
+    };
+
+    // FFT functions
+    inline size_t NextPowerOfTwo(size_t n)
+    {
+        size_t power = 1;
+        while (power < n)
+        {
+            power <<= 1;
+        }
+        return power;
+    }
+
+    // In-place iterative radix-2 FFT, data.size() must be a power of 2. The inverse is left unnormalised
+    inline void FFT(std::vector<std::complex<double>> &data, bool inverse = false)
+    {
+        const size_t n = data.size();
+        if (n < 2)
+            return;
+
+        // Bit reversal permutation
+        for (size_t i = 1, j = 0; i < n; ++i)
+        {
+            size_t bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+            {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j)
+            {
+                std::swap(data[i], data[j]);
+            }
+        }
+
+        // Twiddles computed once per transform rather than accumulated per stage
+        const double sign = inverse ? 1.0 : -1.0;
+        std::vector<std::complex<double>> twiddles(n / 2);
+        for (size_t k = 0; k < n / 2; ++k)
+        {
+            twiddles[k] = std::polar(1.0, sign * 2.0 * M_PI * double(k) / double(n));
+        }
+
+        for (size_t len = 2; len <= n; len <<= 1)
+        {
+            const size_t half = len / 2;
+            const size_t stride = n / len;
+            for (size_t start = 0; start < n; start += len)
+            {
+                for (size_t k = 0; k < half; ++k)
+                {
+                    const std::complex<double> u = data[start + k];
+                    const std::complex<double> v = data[start + k + half] * twiddles[k * stride];
+                    data[start + k] = u + v;
+                    data[start + k + half] = u - v;
+                }
+            }
+        }
+    }
+
+    // Normalised autocorrelation of two real series from a single complex FFT pair.
+    // x goes in the real part and y in the imaginary part, both zero-padded to >= 2N so there's no wrap-around.
+    // An empty y just wastes the imaginary half.
+    inline std::pair<std::vector<double>, std::vector<double>> AutoCorrelationPair(const std::vector<double> &x,
+                                                                                    const std::vector<double> &y)
+    {
+        const size_t n_fft = NextPowerOfTwo(2 * std::max(x.size(), y.size()));
+        std::vector<std::complex<double>> z(n_fft, {0.0, 0.0});
+
+        auto mean = [](const std::vector<double> &vals)
+        {
+            double sum = 0;
+            for (double val : vals)
+                sum += val;
+            return vals.empty() ? 0.0 : sum / double(vals.size());
+        };
+
+        const double mean_x = mean(x);
+        const double mean_y = mean(y);
+        for (size_t i = 0; i < x.size(); ++i)
+            z[i].real(x[i] - mean_x);
+        for (size_t i = 0; i < y.size(); ++i)
+            z[i].imag(y[i] - mean_y);
+
+        FFT(z);
+
+        // Split the spectra and pack the two (real, even) power spectra back into z. Bins k and n_fft - k
+        // only need each other and get the same power, so each pair is written together in place
+        for (size_t k = 0; k <= n_fft / 2; ++k)
+        {
+            const size_t k_mirror = (n_fft - k) % n_fft;
+            const std::complex<double> z_k = z[k];
+            const std::complex<double> z_conj = std::conj(z[k_mirror]);
+            const std::complex<double> x_k = 0.5 * (z_k + z_conj);
+            const std::complex<double> y_k = std::complex<double>(0.0, -0.5) * (z_k - z_conj);
+            z[k] = z[k_mirror] = {std::norm(x_k), std::norm(y_k)};
+        }
+
+        FFT(z, true);
+
+        auto normalise = [&z](size_t n_samples, bool use_real)
+        {
+            std::vector<double> acf(n_samples);
+            if (n_samples == 0)
+                return acf;
+
+            const double variance = use_real ? z[0].real() : z[0].imag();
+            for (size_t k = 0; k < n_samples; ++k)
+            {
+                const double acov = use_real ? z[k].real() : z[k].imag();
+                // Fixed parameters are fully correlated
+                acf[k] = variance > 0 ? acov / variance : 1.0;
+            }
+            return acf;
+        };
+
+        return {normalise(x.size(), true), normalise(y.size(), false)};
+    }
+
+    inline std::vector<double> AutoCorrelation(const std::vector<double> &x)
+    {
+        return AutoCorrelationPair(x, {}).first;
+    }
+
+    // Peak memory of AutoCorrelationPair per FFT point: the complex array, the FFT's twiddles and the two
+    // autocorrelations it returns (n_fft >= 2N, so at most one double per point between them)
+    constexpr size_t kBytesPerFFTPoint = 32;
+
+    // Sokal's automatic window, stops at the first lag M with M >= window_factor * tau(M)
+    inline double IntegratedAutoCorrelationTime(const std::vector<double> &acf, double window_factor = 5.0)
+    {
+        if (acf.empty())
+            return 0;
+
+        double tau = 1.0;
+        for (size_t lag = 1; lag < acf.size(); ++lag)
+        {
+            tau += 2.0 * acf[lag];
+            if (double(lag) >= window_factor * tau)
+                break;
+        }
+        return std::max(tau, 1.0);
+    }
+
+    // Sum over the new block of current[j] * series[j - lag] for lag 0 -> max_lag, where series is previous followed by current.
+    // Lets running lag sums be extended at a cost that scales with the new block rather than the whole chain
+    inline std::vector<double> LaggedCrossProducts(const std::vector<double> &previous,
+                                                   const std::vector<double> &current,
+                                                   int max_lag)
+    {
+        const size_t n_series = previous.size() + current.size();
+        const size_t n_fft = NextPowerOfTwo(n_series + max_lag + 1);
+
+        // Real part only holds the new values, imaginary part holds the full series
+        std::vector<std::complex<double>> z(n_fft, {0.0, 0.0});
+        for (size_t i = 0; i < previous.size(); ++i)
+            z[i].imag(previous[i]);
+        for (size_t i = 0; i < current.size(); ++i)
+            z[previous.size() + i] = {current[i], current[i]};
+
+        FFT(z);
+
+        std::vector<std::complex<double>> cross(n_fft);
+        for (size_t k = 0; k < n_fft; ++k)
+        {
+            const std::complex<double> z_k = z[k];
+            const std::complex<double> z_conj = std::conj(z[(n_fft - k) % n_fft]);
+            const std::complex<double> new_k = 0.5 * (z_k + z_conj);
+            const std::complex<double> series_k = std::complex<double>(0.0, -0.5) * (z_k - z_conj);
+            cross[k] = new_k * std::conj(series_k);
+        }
+
+        FFT(cross, true);
+
+        std::vector<double> lag_sums(max_lag + 1, 0.0);
+        for (int lag = 0; lag <= max_lag && size_t(lag) < n_series; ++lag)
+        {
+            lag_sums[lag] = cross[lag].real() / double(n_fft);
+        }
+        return lag_sums;
+    }
+
+    inline ParameterResult SummariseAutoCorrelation(const std::string &name, std::vector<double> acf, int max_lag, Long64_t n_samples = -1)
+    {
+        ParameterResult result;
+        result.name = name;
+        result.n_samples = n_samples < 0 ? Long64_t(acf.size()) : n_samples;
+        result.integrated_time = std::min(IntegratedAutoCorrelationTime(acf), double(result.n_samples));
+        result.effective_sample_size = result.n_samples > 0 ? double(result.n_samples) / result.integrated_time : 0;
+
+        acf.resize(std::min<size_t>(acf.size(), max_lag + 1));
+        result.autocorrelation = std::move(acf);
+        return result;
+    }
+
+    // Tree reading functions
+    inline std::vector<std::string> GetParameterBranches(TTree *tree)
+    {
+        // Anything stored as a double that isn't the step counter
+        std::vector<std::string> parameter_names;
+        TIter next(tree->GetListOfBranches());
+        TBranch *branch;
+        while ((branch = dynamic_cast<TBranch *>(next())))
+        {
+            std::string name = branch->GetName();
+            TLeaf *leaf = branch->GetLeaf(name.c_str());
+            if (name == "step" || !leaf || std::string(leaf->GetTypeName()) != "Double_t")
+            {
+                continue;
+            }
+            parameter_names.push_back(name);
+        }
+        return parameter_names;
+    }
+
+    // Reads a block of columns in step order, only the requested branches are decompressed.
+    // Entries with step <= step_cut are skipped, like compare_posteriors. last_entry < 0 reads to the end of the tree
+    inline std::vector<std::vector<double>> ReadColumns(TTree *tree,
+                                                        const std::vector<std::string> &names,
+                                                        int step_cut = 0,
+                                                        Long64_t first_entry = 0,
+                                                        Long64_t last_entry = -1)
+    {
+        const Long64_t n_entries = last_entry < 0 ? tree->GetEntries() : std::min(last_entry, tree->GetEntries());
+        std::vector<std::vector<double>> columns(names.size());
+        std::vector<double> row(names.size());
+        int step = 0;
+
+        tree->SetBranchStatus("*", false);
+        tree->SetBranchStatus("step", true);
+        tree->SetBranchAddress("step", &step);
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            tree->SetBranchStatus(names[i].c_str(), true);
+            tree->SetBranchAddress(names[i].c_str(), &row[i]);
+            columns[i].reserve(std::max(n_entries - first_entry, Long64_t(0)));
+        }
+
+        for (Long64_t entry = first_entry; entry < n_entries; ++entry)
+        {
+            tree->GetEntry(entry);
+            if (step <= step_cut)
+            {
+                continue;
+            }
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                columns[i].push_back(row[i]);
+            }
+        }
+
+        tree->ResetBranchAddresses();
+        tree->SetBranchStatus("*", true);
+        return columns;
+    }
+
+    // Output functions
+    inline void WriteAutoCorrelationDirectory(TFile *output_file, const std::vector<ParameterResult> &results)
+    {
+        TDirectory *autocor_dir = output_file->mkdir("Auto_corr");
+        autocor_dir->cd();
+        for (const auto &result : results)
+        {
+            // Same naming as MaCh3 so plot_diag can pair it with <name>_Trace
+            const int n_lags = result.autocorrelation.size();
+            TH1D hist((result.name + "_Lag").c_str(), result.name.c_str(), n_lags, 0, n_lags);
+            hist.SetDirectory(nullptr);
+            for (int lag = 0; lag < n_lags; ++lag)
+            {
+                hist.SetBinContent(lag + 1, result.autocorrelation[lag]);
+            }
+            autocor_dir->WriteTObject(&hist);
+        }
+        output_file->cd();
+    }
+
+    inline void WriteSummaryTree(TFile *output_file, const std::vector<ParameterResult> &results)
+    {
+        output_file->cd();
+        std::string parameter;
+        double integrated_time, effective_sample_size;
+        Long64_t n_samples;
+
+        TTree summary("ac_summary", "Autocorrelation summary");
+        summary.Branch("parameter", &parameter);
+        summary.Branch("integrated_time", &integrated_time);
+        summary.Branch("effective_sample_size", &effective_sample_size);
+        summary.Branch("n_samples", &n_samples);
+
+        for (const auto &result : results)
+        {
+            parameter = result.name;
+            integrated_time = result.integrated_time;
+            effective_sample_size = result.effective_sample_size;
+            n_samples = result.n_samples;
+            summary.Fill();
+
+            std::cout << result.name << " : tau = " << integrated_time << ", ESS = " << effective_sample_size << std::endl;
+        }
+        summary.Write();
+    }
+
+    // Reads back what WriteAutoCorrelationDirectory and WriteSummaryTree wrote
+    inline std::vector<ParameterResult> ReadResults(TFile *input_file)
+    {
+        TTree *summary = nullptr;
+        TDirectory *autocor_dir = nullptr;
+        input_file->GetObject("ac_summary", summary);
+        input_file->GetObject("Auto_corr", autocor_dir);
+        if (!summary || !autocor_dir)
+        {
+            throw std::runtime_error("No autocorrelation summary in file: " + std::string(input_file->GetName()));
+        }
+
+        std::string *parameter = nullptr;
+        double integrated_time = 0, effective_sample_size = 0;
+        Long64_t n_samples = 0;
+        summary->SetBranchAddress("parameter", &parameter);
+        summary->SetBranchAddress("integrated_time", &integrated_time);
+        summary->SetBranchAddress("effective_sample_size", &effective_sample_size);
+        summary->SetBranchAddress("n_samples", &n_samples);
+
+        std::vector<ParameterResult> results(summary->GetEntries());
+        for (Long64_t entry = 0; entry < summary->GetEntries(); ++entry)
+        {
+            summary->GetEntry(entry);
+            ParameterResult &result = results[entry];
+            result.name = *parameter;
+            result.integrated_time = integrated_time;
+            result.effective_sample_size = effective_sample_size;
+            result.n_samples = n_samples;
+
+            TH1D *hist = nullptr;
+            autocor_dir->GetObject((result.name + "_Lag").c_str(), hist);
+            if (hist)
+            {
+                for (int bin = 1; bin <= hist->GetNbinsX(); ++bin)
+                    result.autocorrelation.push_back(hist->GetBinContent(bin));
+                delete hist;
+            }
+        }
+        summary->ResetBranchAddresses();
+        delete parameter;
+        return results;
+    }
+
+    // Main processing functions
+    // read_batch returns the post step cut columns of the requested parameters, in order.
+    // Pairs are transformed in waves whose FFT workspace fits in memory_mb
+    inline std::vector<ParameterResult> ProcessColumns(const std::vector<std::string> &parameter_names,
+                                                       const std::function<std::vector<std::vector<double>>(const std::vector<std::string> &)> &read_batch,
+                                                       int max_lag = 25000,
+                                                       size_t batch_size = 64,
+                                                       unsigned int n_threads = 0,
+                                                       size_t memory_mb = 4096)
+    {
+        std::vector<ParameterResult> results(parameter_names.size());
+        ROOT::TThreadExecutor pool(n_threads);
+        const size_t memory_bytes = memory_mb * 1024 * 1024;
+        bool warned = false;
+
+        // Parameters are read in batches to keep memory at batch_size columns
+        for (size_t batch_start = 0; batch_start < parameter_names.size(); batch_start += batch_size)
+        {
+            const size_t batch_end = std::min(batch_start + batch_size, parameter_names.size());
+            std::vector<std::string> batch_names(parameter_names.begin() + batch_start, parameter_names.begin() + batch_end);
+
+            std::cout << "Reading parameters " << batch_start << " -> " << batch_end << " of " << parameter_names.size() << std::endl;
+            std::vector<std::vector<double>> columns;
+            {
+                Benchmark::ScopedStage stage("read");
+                columns = read_batch(batch_names);
+            }
+
+            // Two parameters per FFT
+            Benchmark::ScopedStage stage("compute");
+            const unsigned int n_pairs = (batch_names.size() + 1) / 2;
+
+            size_t n_samples = 0;
+            for (const auto &column : columns)
+                n_samples = std::max(n_samples, column.size());
+            const size_t pair_bytes = NextPowerOfTwo(2 * n_samples) * kBytesPerFFTPoint;
+            if (pair_bytes > memory_bytes && !warned)
+            {
+                std::cerr << "WARNING::One FFT pair of " << n_samples << " samples needs " << double(pair_bytes) / (1024 * 1024)
+                          << " MB, more than memory_mb = " << memory_mb << ", running one pair at a time" << std::endl;
+                warned = true;
+            }
+            const unsigned int wave_size = std::clamp<size_t>(memory_bytes / pair_bytes, 1, n_pairs);
+
+            for (unsigned int wave_start = 0; wave_start < n_pairs; wave_start += wave_size)
+            {
+                pool.Foreach([&](unsigned int wave_pair)
+                             {
+                    const size_t first = 2 * (wave_start + wave_pair);
+                    const size_t second = first + 1;
+                    const bool has_second = second < batch_names.size();
+
+                    static const std::vector<double> no_column;
+                    const std::vector<double> &second_column = has_second ? columns[second] : no_column;
+                    auto acfs = AutoCorrelationPair(columns[first], second_column);
+                    std::vector<double>().swap(columns[first]);
+                    results[batch_start + first] = SummariseAutoCorrelation(batch_names[first], std::move(acfs.first), max_lag);
+
+                    if (has_second)
+                    {
+                        std::vector<double>().swap(columns[second]);
+                        results[batch_start + second] = SummariseAutoCorrelation(batch_names[second], std::move(acfs.second), max_lag);
+                    } },
+                             ROOT::TSeqU(std::min(wave_size, n_pairs - wave_start)));
+            }
+        }
+
+        return results;
+    }
+
+    inline std::vector<ParameterResult> ProcessPosteriorTree(TTree *tree,
+                                                             int max_lag = 25000,
+                                                             int step_cut = 0,
+                                                             size_t batch_size = 64,
+                                                             unsigned int n_threads = 0,
+                                                             size_t memory_mb = 4096)
+    {
+        if (!tree)
+        {
+            throw std::invalid_argument("No posteriors tree provided");
+        }
+
+        auto read_batch = [&](const std::vector<std::string> &names)
+        {
+            return ReadColumns(tree, names, step_cut);
+        };
+        return ProcessColumns(GetParameterBranches(tree), read_batch, max_lag, batch_size, n_threads, memory_mb);
+    }
+
+} // namespace AutoCorrelationEngine
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+
+#include <sys/resource.h>
+
+#include <TFile.h>
+
+// Per stage instrumentation for the macros. Each macro marks its open, read, compute and render
+// sections with a ScopedStage, which costs nothing unless a Recorder case is running (diag_benchmark).
+// Stages nest exclusively: time spent in an inner stage isn't counted again in the one around it.
+// Only meant to be used from the thread that runs the macro.
+namespace Benchmark
+{
+
+    struct Snapshot
+    {
+        std::chrono::steady_clock::time_point time;
+        Long64_t root_bytes_read = 0;   // TFile::GetFileBytesRead, compressed bytes ROOT asked for
+        Long64_t system_bytes_read = 0; // rchar from /proc/self/io, every read() but not mmapped pages
+        long major_faults = 0;          // Pages that had to come from disk, including mmapped ones
+        long rss_kb = 0;
+        long peak_rss_kb = 0; // Highest RSS since the previous snapshot
+    };
+
+    inline Long64_t GetSystemBytesRead()
+    {
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        Long64_t value = 0;
+        while (io >> key >> value)
+        {
+            if (key == "rchar:")
+                return value;
+        }
+        return -1;
+    }
+
+    // VmRSS and VmHWM from /proc/self/status, false if they aren't there
+    inline bool GetMemoryUsage(long &rss_kb, long &peak_rss_kb)
+    {
+        std::ifstream status("/proc/self/status");
+        std::string key;
+        long value = 0;
+        rss_kb = peak_rss_kb = -1;
+        while (status >> key)
+        {
+            if (key == "VmRSS:" && status >> value)
+                rss_kb = value;
+            else if (key == "VmHWM:" && status >> value)
+                peak_rss_kb = value;
+            status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        return rss_kb >= 0 && peak_rss_kb >= 0;
+    }
+
+    // Each snapshot resets VmHWM (Linux >= 4.0), so its peak covers only the time since the previous one.
+    // Where that isn't possible the peak is the process high water mark so far
+    inline Snapshot TakeSnapshot()
+    {
+        Snapshot snapshot;
+        snapshot.time = std::chrono::steady_clock::now();
+        snapshot.root_bytes_read = TFile::GetFileBytesRead();
+        snapshot.system_bytes_read = GetSystemBytesRead();
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        snapshot.major_faults = usage.ru_majflt;
+        if (GetMemoryUsage(snapshot.rss_kb, snapshot.peak_rss_kb))
+        {
+            std::ofstream("/proc/self/clear_refs") << "5";
+        }
+        else
+        {
+#ifdef __APPLE__
+            snapshot.peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+            snapshot.peak_rss_kb = usage.ru_maxrss;
+#endif
+            snapshot.rss_kb = snapshot.peak_rss_kb;
+        }
+        return snapshot;
+    }
+
+    struct StageMetrics
+    {
+        std::string name;
+        int calls = 0;
+        double wall_seconds = 0;
+        Long64_t root_bytes_read = 0;
+        Long64_t system_bytes_read = 0;
+        long major_faults = 0;
+        long peak_rss_kb = 0;  // Highest RSS while the stage was running
+        long rss_growth_kb = 0; // RSS at the end of the stage minus at its start, what it left allocated
+
+        void Add(const Snapshot &start, const Snapshot &end)
+        {
+            wall_seconds += std::chrono::duration<double>(end.time - start.time).count();
+            root_bytes_read += end.root_bytes_read - start.root_bytes_read;
+            system_bytes_read += end.system_bytes_read - start.system_bytes_read;
+            major_faults += end.major_faults - start.major_faults;
+            peak_rss_kb = std::max(peak_rss_kb, end.peak_rss_kb);
+            rss_growth_kb += end.rss_kb - start.rss_kb;
+        }
+    };
+
+    // Escapes the few characters that can turn up in names and paths
+    inline std::string JSONString(const std::string &value)
+    {
+        std::string escaped = "\"";
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            if (c == '\n')
+            {
+                escaped += "\\n";
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped + "\"";
+    }
+
+    inline std::string JSONNumber(double value)
+    {
+        std::ostringstream stream;
+        stream.precision(10);
+        stream << value;
+        return stream.str();
+    }
+
+    class Recorder
+    {
+    public:
+        static Recorder &Get()
+        {
+            static Recorder recorder;
+            return recorder;
+        }
+
+        bool IsActive() const { return active_; }
+
+        void StartCase(const std::string &name)
+        {
+            case_name_ = name;
+            stages_.clear();
+            checks_.clear();
+            open_.clear();
+            active_ = true;
+            case_start_ = TakeSnapshot();
+            case_peak_rss_kb_ = case_start_.rss_kb;
+        }
+
+        void StopCase()
+        {
+            while (!open_.empty())
+                EndStage();
+            case_end_ = Take();
+            active_ = false;
+        }
+
+        // Extra numbers reported with the case, e.g. how far a result is from the expected one
+        void AddCheck(const std::string &name, double value)
+        {
+            checks_.emplace_back(name, value);
+        }
+
+        void BeginStage(const std::string &name)
+        {
+            const Snapshot now = Take();
+            if (!open_.empty())
+                GetStage(open_.back().first).Add(open_.back().second, now);
+            open_.emplace_back(name, now);
+            GetStage(name).calls++;
+        }
+
+        void EndStage()
+        {
+            if (open_.empty())
+                return;
+            const Snapshot now = Take();
+            GetStage(open_.back().first).Add(open_.back().second, now);
+            open_.pop_back();
+            if (!open_.empty())
+                open_.back().second = now;
+        }
+
+        std::string ToJSON() const
+        {
+            StageMetrics total;
+            total.Add(case_start_, case_end_);
+            total.peak_rss_kb = case_peak_rss_kb_;
+
+            std::ostringstream json;
+            json << "{\"name\": " << JSONString(case_name_)
+                 << ", \"wall_seconds\": " << JSONNumber(total.wall_seconds)
+                 << ", \"root_bytes_read\": " << total.root_bytes_read
+                 << ", \"system_bytes_read\": " << total.system_bytes_read
+                 << ", \"major_faults\": " << total.major_faults
+                 << ", \"peak_rss_kb\": " << total.peak_rss_kb
+                 << ", \"rss_growth_kb\": " << total.rss_growth_kb
+                 << ", \"stages\": {";
+            for (size_t i = 0; i < stages_.size(); ++i)
+            {
+                const StageMetrics &stage = stages_[i];
+                json << (i ? ", " : "") << JSONString(stage.name)
+                     << ": {\"calls\": " << stage.calls
+                     << ", \"wall_seconds\": " << JSONNumber(stage.wall_seconds)
+                     << ", \"root_bytes_read\": " << stage.root_bytes_read
+                     << ", \"system_bytes_read\": " << stage.system_bytes_read
+                     << ", \"major_faults\": " << stage.major_faults
+                     << ", \"peak_rss_kb\": " << stage.peak_rss_kb
+                     << ", \"rss_growth_kb\": " << stage.rss_growth_kb << "}";
+            }
+            json << "}, \"checks\": {";
+            for (size_t i = 0; i < checks_.size(); ++i)
+            {
+                json << (i ? ", " : "") << JSONString(checks_[i].first) << ": " << JSONNumber(checks_[i].second);
+            }
+            json << "}}";
+            return json.str();
+        }
+
+    private:
+        Recorder() = default;
+
+        // Snapshots only cover the time since the previous one, the case peak is the highest of them
+        Snapshot Take()
+        {
+            const Snapshot snapshot = TakeSnapshot();
+            case_peak_rss_kb_ = std::max(case_peak_rss_kb_, snapshot.peak_rss_kb);
+            return snapshot;
+        }
+
+        StageMetrics &GetStage(const std::string &name)
+        {
+            for (auto &stage : stages_)
+            {
+                if (stage.name == name)
+                    return stage;
+            }
+            stages_.emplace_back();
+            stages_.back().name = name;
+            return stages_.back();
+        }
+
+        bool active_ = false;
+        std::string case_name_;
+        Snapshot case_start_, case_end_;
+        long case_peak_rss_kb_ = 0;
+        std::vector<StageMetrics> stages_;
+        std::vector<std::pair<std::string, Snapshot>> open_;
+        std::vector<std::pair<std::string, double>> checks_;
+    };
+
+    class ScopedStage
+    {
+    public:
+        explicit ScopedStage(const char *name) : active_(Recorder::Get().IsActive())
+        {
+            if (active_)
+                Recorder::Get().BeginStage(name);
+        }
+
+        ~ScopedStage()
+        {
+            if (active_ && Recorder::Get().IsActive())
+                Recorder::Get().EndStage();
+        }
+
+        ScopedStage(const ScopedStage &) = delete;
+        ScopedStage &operator=(const ScopedStage &) = delete;
+
+    private:
+        bool active_;
+    };
+
+} // namespace Benchmark
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TString.h>
+
+#include "autocorrelation_engine.h"
+#include "sidecar_file.h"
+
+// Columnar copy of a posteriors tree (<chain>.columns by default), one contiguous float64 or float32
+// array per parameter plus the steps, so any parameter and step window can be mapped straight in
+// without decompressing baskets. chain_columns.py reads the same layout, keep the two in sync.
+namespace ChainColumns
+{
+
+    // Format
+    constexpr char kMagic[8] = {'D', 'M', 'C', 'O', 'L', 'M', 'N', '\0'};
+    constexpr uint32_t kVersion = 2;
+    constexpr uint32_t kContiguousSteps = 1; // step = first step + entry, so step windows are O(1)
+    constexpr uint64_t kColumnAlignment = 64;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_parameters;
+        uint64_t source_size;
+        int64_t source_mtime; // ns
+        uint64_t n_entries;
+        int64_t burn_in;        // Step cut the burn-in entry was found for
+        uint64_t burn_in_entry; // First entry with step > burn_in
+        uint64_t steps_offset;  // int64 per entry
+        uint64_t records_offset;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+
+    struct ParameterRecord
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t element_size; // 8 for double, 4 for float
+        uint64_t data_offset;
+        double min_val; // Over every step
+        double max_val;
+    };
+
+    static_assert(sizeof(FileHeader) == 80, "Chain columns header layout changed");
+    static_assert(sizeof(ParameterRecord) == 40, "Chain columns record layout changed");
+
+    inline uint64_t AlignOffset(uint64_t offset)
+    {
+        return (offset + kColumnAlignment - 1) / kColumnAlignment * kColumnAlignment;
+    }
+
+    // Writing
+    // One pass over the tree, chunk_entries rows are buffered per parameter and written into place so
+    // memory doesn't grow with the chain
+    inline void WriteColumns(TTree *tree,
+                             const SidecarFile::SourceIdentity &identity,
+                             const std::string &output_path,
+                             bool single_precision = false,
+                             int burn_in = 100000,
+                             Long64_t chunk_entries = 4096)
+    {
+        const auto names = AutoCorrelationEngine::GetParameterBranches(tree);
+        const size_t n_parameters = names.size();
+        const uint64_t n_entries = tree->GetEntries();
+        const uint32_t element_size = single_precision ? sizeof(float) : sizeof(double);
+
+        // Layout
+        std::vector<ParameterRecord> records(n_parameters);
+        uint64_t offset = sizeof(FileHeader) + n_parameters * sizeof(ParameterRecord);
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            std::memset(&records[i], 0, sizeof(ParameterRecord));
+            records[i].name_offset = offset;
+            records[i].name_length = names[i].size();
+            records[i].element_size = element_size;
+            records[i].min_val = std::numeric_limits<double>::max();
+            records[i].max_val = std::numeric_limits<double>::lowest();
+            offset += names[i].size();
+        }
+
+        const uint64_t steps_offset = AlignOffset(offset);
+        offset = steps_offset + n_entries * sizeof(int64_t);
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            records[i].data_offset = AlignOffset(offset);
+            offset = records[i].data_offset + n_entries * element_size;
+        }
+        const uint64_t file_size = offset;
+
+        const std::string temp_path = output_path + ".tmp" + std::to_string(getpid());
+        const int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not write chain columns: " + temp_path);
+        }
+
+        bool ok = ftruncate(fd, file_size) == 0;
+        auto write_at = [&](const void *data, size_t size, uint64_t position)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            while (ok && size > 0)
+            {
+                const ssize_t written = pwrite(fd, bytes, size, position);
+                ok = written > 0;
+                bytes += written;
+                size -= written;
+                position += written;
+            }
+        };
+
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            write_at(names[i].data(), names[i].size(), records[i].name_offset);
+        }
+
+        // Columns
+        std::vector<double> row(n_parameters);
+        int step = 0;
+        tree->SetBranchStatus("*", false);
+        tree->SetBranchStatus("step", true);
+        tree->SetBranchAddress("step", &step);
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            tree->SetBranchStatus(names[i].c_str(), true);
+            tree->SetBranchAddress(names[i].c_str(), &row[i]);
+        }
+
+        std::vector<int64_t> step_chunk(chunk_entries);
+        std::vector<std::vector<double>> double_chunks(single_precision ? 0 : n_parameters, std::vector<double>(chunk_entries));
+        std::vector<std::vector<float>> float_chunks(single_precision ? n_parameters : 0, std::vector<float>(chunk_entries));
+
+        int64_t first_step = 0;
+        bool contiguous = true;
+        uint64_t burn_in_entry = n_entries;
+
+        for (uint64_t chunk_start = 0; chunk_start < n_entries && ok; chunk_start += chunk_entries)
+        {
+            const uint64_t chunk_size = std::min<uint64_t>(chunk_entries, n_entries - chunk_start);
+            for (uint64_t j = 0; j < chunk_size; ++j)
+            {
+                const uint64_t entry = chunk_start + j;
+                tree->GetEntry(entry);
+
+                if (entry == 0)
+                    first_step = step;
+                contiguous &= step == first_step + int64_t(entry);
+                if (burn_in_entry == n_entries && step > burn_in)
+                    burn_in_entry = entry;
+
+                step_chunk[j] = step;
+                for (size_t i = 0; i < n_parameters; ++i)
+                {
+                    records[i].min_val = std::min(records[i].min_val, row[i]);
+                    records[i].max_val = std::max(records[i].max_val, row[i]);
+                    if (single_precision)
+                        float_chunks[i][j] = row[i];
+                    else
+                        double_chunks[i][j] = row[i];
+                }
+            }
+
+            write_at(step_chunk.data(), chunk_size * sizeof(int64_t), steps_offset + chunk_start * sizeof(int64_t));
+            for (size_t i = 0; i < n_parameters; ++i)
+            {
+                const void *chunk = single_precision ? static_cast<const void *>(float_chunks[i].data()) : static_cast<const void *>(double_chunks[i].data());
+                write_at(chunk, chunk_size * element_size, records[i].data_offset + chunk_start * element_size);
+            }
+        }
+        tree->ResetBranchAddresses();
+        tree->SetBranchStatus("*", true);
+
+        // Header last, once the ranges and burn-in are known
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.n_parameters = n_parameters;
+        header.source_size = identity.size;
+        header.source_mtime = identity.mtime;
+        header.n_entries = n_entries;
+        header.burn_in = burn_in;
+        header.burn_in_entry = burn_in_entry;
+        header.steps_offset = steps_offset;
+        header.records_offset = sizeof(FileHeader);
+        header.flags = contiguous ? kContiguousSteps : 0;
+
+        write_at(&header, sizeof(header), 0);
+        write_at(records.data(), n_parameters * sizeof(ParameterRecord), header.records_offset);
+        ok &= close(fd) == 0;
+
+        if (!ok || std::rename(temp_path.c_str(), output_path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Could not write chain columns: " + output_path);
+        }
+    }
+
+    // Reading
+    class ColumnFile
+    {
+    public:
+        // Returns nullptr if the file is missing or isn't a valid column file
+        static std::unique_ptr<ColumnFile> Open(const std::string &path)
+        {
+            auto file = SidecarFile::MappedFile::Open(path);
+            if (!file || file->GetSize() < sizeof(FileHeader))
+                return nullptr;
+
+            std::unique_ptr<ColumnFile> columns(new ColumnFile(std::move(file)));
+            if (!columns->IsValid())
+                return nullptr;
+
+            return columns;
+        }
+
+        // The <chain>.columns sidecar, only if it's still up to date with the chain
+        static std::unique_ptr<ColumnFile> OpenFor(const std::string &chain_file)
+        {
+            SidecarFile::SourceIdentity identity;
+            if (!SidecarFile::GetSourceIdentity(chain_file, identity))
+                return nullptr;
+
+            auto columns = Open(SidecarFile::GetSidecarPath(identity, ".columns"));
+            if (!columns || !columns->Matches(identity))
+                return nullptr;
+
+            return columns;
+        }
+
+        const FileHeader &GetHeader() const { return *file_->At<FileHeader>(0); }
+        size_t GetNParameters() const { return GetHeader().n_parameters; }
+        uint64_t GetNEntries() const { return GetHeader().n_entries; }
+        uint64_t GetBurnInEntry() const { return GetHeader().burn_in_entry; }
+        const ParameterRecord &GetRecord(size_t i) const { return file_->At<ParameterRecord>(GetHeader().records_offset)[i]; }
+        const int64_t *GetSteps() const { return file_->At<int64_t>(GetHeader().steps_offset); }
+
+        std::string GetName(size_t i) const
+        {
+            const ParameterRecord &record = GetRecord(i);
+            return std::string(file_->At<char>(record.name_offset), record.name_length);
+        }
+
+        std::vector<std::string> GetNames() const
+        {
+            std::vector<std::string> names;
+            for (size_t i = 0; i < GetNParameters(); ++i)
+                names.push_back(GetName(i));
+            return names;
+        }
+
+        // -1 if the parameter isn't in the file
+        int Find(const std::string &name) const
+        {
+            auto it = index_.find(name);
+            return it == index_.end() ? -1 : it->second;
+        }
+
+        bool Matches(const SidecarFile::SourceIdentity &identity) const
+        {
+            return GetHeader().source_size == identity.size && GetHeader().source_mtime == identity.mtime;
+        }
+
+        // Entries [first, last) with step_lo <= step <= step_hi
+        std::pair<uint64_t, uint64_t> GetEntryRange(int64_t step_lo, int64_t step_hi) const
+        {
+            const uint64_t n_entries = GetNEntries();
+            if (n_entries == 0 || step_hi < step_lo)
+                return {0, 0};
+
+            const int64_t *steps = GetSteps();
+            if (GetHeader().flags & kContiguousSteps)
+            {
+                // Compared against the chain's own steps before subtracting, callers pass the int64 limits for open ends
+                const int64_t first_step = steps[0];
+                const int64_t last_step = steps[n_entries - 1];
+                const uint64_t first = step_lo <= first_step ? 0 : step_lo > last_step ? n_entries : uint64_t(step_lo - first_step);
+                const uint64_t last = step_hi >= last_step ? n_entries : step_hi < first_step ? 0 : uint64_t(step_hi - first_step + 1);
+                return {first, std::max(first, last)};
+            }
+
+            const uint64_t first = std::lower_bound(steps, steps + n_entries, step_lo) - steps;
+            const uint64_t last = std::upper_bound(steps, steps + n_entries, step_hi) - steps;
+            return {first, std::max(first, last)};
+        }
+
+        // Zero-copy access, nullptr if the column isn't stored as T
+        template <typename T>
+        const T *GetColumn(size_t i) const
+        {
+            const ParameterRecord &record = GetRecord(i);
+            return record.element_size == sizeof(T) ? file_->At<T>(record.data_offset) : nullptr;
+        }
+
+        // Copy of entries [first, last) as doubles whatever the stored precision
+        std::vector<double> ReadColumn(size_t i, uint64_t first, uint64_t last) const
+        {
+            last = std::min(last, GetNEntries());
+            if (first >= last)
+                return {};
+
+            if (const double *column = GetColumn<double>(i))
+                return std::vector<double>(column + first, column + last);
+
+            const float *column = GetColumn<float>(i);
+            return std::vector<double>(column + first, column + last);
+        }
+
+        // Same as AutoCorrelationEngine::ReadColumns, entries with step <= step_cut are skipped
+        std::vector<std::vector<double>> ReadColumns(const std::vector<std::string> &names, int step_cut = 0) const
+        {
+            const auto range = GetEntryRange(int64_t(step_cut) + 1, std::numeric_limits<int64_t>::max());
+            std::vector<std::vector<double>> columns;
+            columns.reserve(names.size());
+            for (const auto &name : names)
+            {
+                const int index = Find(name);
+                if (index < 0)
+                {
+                    throw std::runtime_error("Parameter not in chain columns: " + name);
+                }
+                columns.push_back(ReadColumn(index, range.first, range.second));
+            }
+            return columns;
+        }
+
+    private:
+        ColumnFile(std::unique_ptr<SidecarFile::MappedFile> file) : file_(std::move(file)) {}
+
+        bool IsValid()
+        {
+            const FileHeader &header = GetHeader();
+            const size_t file_size = file_->GetSize();
+            if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion)
+                return false;
+
+            if (header.records_offset + uint64_t(header.n_parameters) * sizeof(ParameterRecord) > file_size ||
+                header.steps_offset + header.n_entries * sizeof(int64_t) > file_size)
+                return false;
+
+            for (size_t i = 0; i < header.n_parameters; ++i)
+            {
+                const ParameterRecord &record = GetRecord(i);
+                if ((record.element_size != sizeof(double) && record.element_size != sizeof(float)) ||
+                    record.name_offset + record.name_length > file_size ||
+                    record.data_offset + header.n_entries * record.element_size > file_size)
+                    return false;
+                index_[GetName(i)] = i;
+            }
+            return true;
+        }
+
+        std::unique_ptr<SidecarFile::MappedFile> file_;
+        std::unordered_map<std::string, int> index_;
+    };
+
+    // Converts chain_file's posteriors tree, output_path defaults to the <chain>.columns sidecar
+    inline std::string ConvertChain(const TString &chain_file,
+                                    std::string output_path = "",
+                                    bool single_precision = false,
+                                    int burn_in = 100000)
+    {
+        SidecarFile::SourceIdentity identity;
+        if (!SidecarFile::GetSourceIdentity(chain_file.Data(), identity))
+        {
+            throw std::runtime_error("Could not find file: " + std::string(chain_file.Data()));
+        }
+        if (output_path.empty())
+        {
+            output_path = SidecarFile::GetSidecarPath(identity, ".columns");
+        }
+
+        std::unique_ptr<TFile> file(TFile::Open(chain_file));
+        if (!file || file->IsZombie())
+        {
+            throw std::runtime_error("Could not open file: " + std::string(chain_file.Data()));
+        }
+
+        TTree *posteriors = nullptr;
+        file->GetObject("posteriors", posteriors);
+        if (!posteriors)
+        {
+            throw std::runtime_error("posteriors tree not found in file: " + std::string(chain_file.Data()));
+        }
+
+        WriteColumns(posteriors, identity, output_path, single_precision, burn_in);
+        return output_path;
+    }
+
+} // namespace ChainColumns
@@ -0,0 +1,105 @@
+import os
+import struct
+import numpy as np
+from sidecar_file import sidecar_path
+
+
+class ChainColumnsReader:
+    '''
+    Reads the memory-mapped columnar chain files written by convert_chain.C
+    Layout must match ChainColumns::FileHeader and ChainColumns::ParameterRecord in chain_columns.h
+    '''
+    _header = struct.Struct("<8sIIQqQqQQQII")
+    _record = struct.Struct("<QIIQdd")
+    _contiguous_steps = 1
+
+    def __init__(self, columns_path: str)->None:
+        '''
+        Constructor for ChainColumnsReader class.
+        :param columns_path: Path to the columns file.
+        '''
+        self._data = np.memmap(columns_path, dtype=np.uint8, mode="r")
+        (magic, version, n_parameters, self.source_size, self.source_mtime, self.n_entries,
+         self.burn_in, self.burn_in_entry, steps_offset, records_offset, self._flags, _) = self._header.unpack_from(self._data, 0)
+
+        if magic != b"DMCOLMN\0" or version != 2:
+            raise ValueError(f"{columns_path} is not a chain columns file")
+
+        self.steps = np.frombuffer(self._data, dtype="<i8", count=self.n_entries, offset=steps_offset)
+
+        self._columns = {}
+        self._ranges = {}
+        for i in range(n_parameters):
+            name_offset, name_length, element_size, data_offset, min_val, max_val = self._record.unpack_from(self._data, records_offset + i * self._record.size)
+            name = bytes(self._data[name_offset:name_offset + name_length]).decode()
+            dtype = {8: "<f8", 4: "<f4"}[element_size]
+            self._columns[name] = np.frombuffer(self._data, dtype=dtype, count=self.n_entries, offset=data_offset)
+            self._ranges[name] = (min_val, max_val)
+
+    @classmethod
+    def open_for(cls, chain_path: str):
+        '''
+        The <chain>.columns file, next to the chain or in the temp directory like convert_chain.C writes it,
+        if it exists and is still up to date with it, otherwise None
+        :param chain_path: Path to the ROOT file the columns were converted from.
+        '''
+        source = os.path.realpath(chain_path)
+        columns_path = sidecar_path(source, ".columns")
+        if not os.path.exists(columns_path):
+            return None
+
+        try:
+            reader = cls(columns_path)
+        except (ValueError, KeyError, struct.error):
+            return None
+
+        info = os.stat(source)
+        if reader.source_size != info.st_size or reader.source_mtime != info.st_mtime_ns:
+            return None
+        return reader
+
+    def __contains__(self, param: str)->bool:
+        return param in self._columns
+
+    def get_params(self):
+        '''
+        Get the list of parameters in the file.
+        :return: A list of parameter names.
+        '''
+        return list(self._columns.keys())
+
+    def get_min_max(self, param: str):
+        '''
+        Range of a parameter over every step, stored at conversion time.
+        '''
+        return self._ranges[param]
+
+    def entry_range(self, step_lo: int, step_hi: int):
+        '''
+        Entries [first, last) with step_lo <= step <= step_hi, O(1) when the steps are contiguous.
+        '''
+        if self.n_entries == 0 or step_hi < step_lo:
+            return 0, 0
+
+        if self._flags & self._contiguous_steps:
+            first_step = int(self.steps[0])
+            first = min(max(step_lo - first_step, 0), self.n_entries)
+            last = min(max(step_hi - first_step + 1, 0), self.n_entries)
+            return first, max(first, last)
+
+        first = int(np.searchsorted(self.steps, step_lo, side="left"))
+        last = int(np.searchsorted(self.steps, step_hi, side="right"))
+        return first, max(first, last)
+
+    def get_column(self, param: str, step_lo: int = None, step_hi: int = None):
+        '''
+        Zero-copy view of a parameter's values over a step window.
+        :param param: The parameter to retrieve.
+        :param step_lo: First step to include, defaults to the first step after the burn-in.
+        :param step_hi: Last step to include, defaults to the end of the chain.
+        :return: The values and their steps.
+        '''
+        step_lo = self.burn_in + 1 if step_lo is None else step_lo
+        step_hi = np.iinfo(np.int64).max if step_hi is None else step_hi
+        first, last = self.entry_range(step_lo, step_hi)
+        return self._columns[param][first:last], self.steps[first:last]
@@ -0,0 +1,672 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <numeric>
+#include <queue>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TString.h>
+#include <TMath.h>
+#include <ROOT/TSeq.hxx>
+#include <ROOT/TThreadExecutor.hxx>
+
+#include "autocorrelation_engine.h"
+#include "chain_columns.h"
+#include "benchmark.h"
+
+// Multi-chain convergence diagnostics from Vehtari, Gelman, Simpson, Carpenter and Buerkner (2021):
+// split R-hat, rank normalised bulk and tail R-hat, and bulk and tail ESS using Stan's cross-chain
+// autocorrelation estimator, matching the R posterior package. Every chain is cut to the same number
+// of post burn-in draws N (rounded down to even) and split in half, so M chains give 2M half chains.
+// A parameter's draws are stored chain after chain, which keeps every half chain contiguous.
+namespace ConvergenceDiagnostics
+{
+
+    struct ParameterConvergence
+    {
+        std::string name;
+        double mean = 0;
+        double sd = 0;
+        double q05 = 0;
+        double median = 0;
+        double q95 = 0;
+        double split_rhat = 0; // Split R-hat of the raw draws
+        double bulk_rhat = 0;  // Split R-hat of the rank normalised draws
+        double tail_rhat = 0;  // Split R-hat of the rank normalised |x - median|
+        double rank_rhat = 0;  // max(bulk_rhat, tail_rhat), the one to cut on
+        double bulk_ess = 0;
+        double tail_ess = 0; // Smaller of the ESS of the 5% and 95% quantiles
+    };
+
+    // Recommended cut on rank_rhat
+    constexpr double kRHatThreshold = 1.01;
+
+    // Estimators
+    // draws holds n_chains chains of n_draws each, NaN if every chain is constant
+    inline double RHat(const double *draws, size_t n_chains, size_t n_draws)
+    {
+        if (n_chains < 2 || n_draws < 2)
+            return std::numeric_limits<double>::quiet_NaN();
+
+        std::vector<double> means(n_chains);
+        double within = 0;
+        for (size_t chain = 0; chain < n_chains; ++chain)
+        {
+            const double *x = draws + chain * n_draws;
+            double sum = 0;
+            for (size_t i = 0; i < n_draws; ++i)
+                sum += x[i];
+            means[chain] = sum / n_draws;
+
+            double sum_sq = 0;
+            for (size_t i = 0; i < n_draws; ++i)
+                sum_sq += (x[i] - means[chain]) * (x[i] - means[chain]);
+            within += sum_sq / (n_draws - 1);
+        }
+        within /= n_chains;
+
+        const double mean = std::accumulate(means.begin(), means.end(), 0.0) / n_chains;
+        double between = 0;
+        for (double chain_mean : means)
+            between += (chain_mean - mean) * (chain_mean - mean);
+        between *= double(n_draws) / (n_chains - 1);
+
+        if (!(within > 0))
+            return std::numeric_limits<double>::quiet_NaN();
+
+        return std::sqrt((between / within + n_draws - 1) / n_draws);
+    }
+
+    // Stan's multi-chain ESS: chain autocovariances are averaged and combined with the between chain
+    // variance, summed over Geyer's initial positive sequence made monotone, and tau is floored at
+    // 1 / log10(M N) so antithetic chains can't claim an unbounded ESS
+    inline double EffectiveSampleSize(const double *draws, size_t n_chains, size_t n_draws)
+    {
+        if (n_chains < 1 || n_draws < 4)
+            return std::numeric_limits<double>::quiet_NaN();
+
+        std::vector<double> mean_acov(n_draws, 0.0);
+        std::vector<double> means(n_chains);
+
+        // Two chains per FFT, the engine's autocorrelations times each chain's biased variance
+        for (size_t chain = 0; chain < n_chains; chain += 2)
+        {
+            const bool has_second = chain + 1 < n_chains;
+            std::vector<double> first(draws + chain * n_draws, draws + (chain + 1) * n_draws);
+            std::vector<double> second;
+            if (has_second)
+                second.assign(draws + (chain + 1) * n_draws, draws + (chain + 2) * n_draws);
+
+            auto acfs = AutoCorrelationEngine::AutoCorrelationPair(first, second);
+            for (int j = 0; j < (has_second ? 2 : 1); ++j)
+            {
+                const std::vector<double> &x = j == 0 ? first : second;
+                const std::vector<double> &acf = j == 0 ? acfs.first : acfs.second;
+
+                const double mean = std::accumulate(x.begin(), x.end(), 0.0) / n_draws;
+                double variance = 0;
+                for (double value : x)
+                    variance += (value - mean) * (value - mean);
+                variance /= n_draws;
+
+                means[chain + j] = mean;
+                for (size_t t = 0; t < n_draws; ++t)
+                    mean_acov[t] += acf[t] * variance / n_chains;
+            }
+        }
+
+        const double within = mean_acov[0] * n_draws / (n_draws - 1);
+        double var_plus = mean_acov[0];
+        if (n_chains > 1)
+        {
+            const double mean = std::accumulate(means.begin(), means.end(), 0.0) / n_chains;
+            double between = 0;
+            for (double chain_mean : means)
+                between += (chain_mean - mean) * (chain_mean - mean);
+            var_plus += between / (n_chains - 1);
+        }
+        if (!(var_plus > 0))
+            return std::numeric_limits<double>::quiet_NaN();
+
+        auto rho = [&](size_t t)
+        {
+            return 1.0 - (within - mean_acov[t]) / var_plus;
+        };
+
+        // Initial positive sequence, sums of adjacent pairs while they stay positive
+        std::vector<double> rho_hat(n_draws, 0.0);
+        double rho_even = 1.0;
+        double rho_odd = rho(1);
+        rho_hat[0] = rho_even;
+        rho_hat[1] = rho_odd;
+
+        size_t t = 0;
+        while (t + 5 < n_draws && std::isfinite(rho_even + rho_odd) && rho_even + rho_odd > 0)
+        {
+            t += 2;
+            rho_even = rho(t);
+            rho_odd = rho(t + 1);
+            if (rho_even + rho_odd >= 0)
+            {
+                rho_hat[t] = rho_even;
+                rho_hat[t + 1] = rho_odd;
+            }
+        }
+        const size_t max_t = t;
+        if (rho_even > 0)
+            rho_hat[max_t] = rho_even;
+
+        // Initial monotone sequence
+        for (t = 2; t + 2 <= max_t; t += 2)
+        {
+            if (rho_hat[t] + rho_hat[t + 1] > rho_hat[t - 2] + rho_hat[t - 1])
+            {
+                rho_hat[t] = 0.5 * (rho_hat[t - 2] + rho_hat[t - 1]);
+                rho_hat[t + 1] = rho_hat[t];
+            }
+        }
+
+        const double n_total = double(n_chains) * n_draws;
+        double tau = -1.0 + 2.0 * std::accumulate(rho_hat.begin(), rho_hat.begin() + max_t, 0.0) + rho_hat[max_t];
+        tau = std::max(tau, 1.0 / std::log10(n_total));
+        return n_total / tau;
+    }
+
+    // Ranks
+    // Indices of one chain's draws in increasing value, written to the chain's slice of order
+    inline void SortChain(const double *draws, size_t chain, size_t n_draws, uint32_t *order)
+    {
+        uint32_t *begin = order + chain * n_draws;
+        std::iota(begin, begin + n_draws, uint32_t(chain * n_draws));
+        std::sort(begin, begin + n_draws, [draws](uint32_t a, uint32_t b)
+                  { return draws[a] < draws[b]; });
+    }
+
+    // k-way merge of the chains sorted by SortChain into the order of every draw
+    inline std::vector<uint32_t> MergeChains(const double *draws, const std::vector<uint32_t> &chain_orders,
+                                             size_t n_chains, size_t n_draws)
+    {
+        using Head = std::pair<double, uint32_t>; // Value, chain
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+        std::vector<size_t> position(n_chains, 0);
+        for (size_t chain = 0; chain < n_chains && n_draws > 0; ++chain)
+            heads.push({draws[chain_orders[chain * n_draws]], uint32_t(chain)});
+
+        std::vector<uint32_t> order;
+        order.reserve(n_chains * n_draws);
+        while (!heads.empty())
+        {
+            const uint32_t chain = heads.top().second;
+            heads.pop();
+            order.push_back(chain_orders[chain * n_draws + position[chain]]);
+            if (++position[chain] < n_draws)
+                heads.push({draws[chain_orders[chain * n_draws + position[chain]]], chain});
+        }
+        return order;
+    }
+
+    // Order of |x - median| from the order of x, walking outwards from the median on both sides
+    inline std::vector<uint32_t> FoldedOrder(const double *draws, const std::vector<uint32_t> &order, double median)
+    {
+        const size_t n_total = order.size();
+        size_t upper = std::partition_point(order.begin(), order.end(), [&](uint32_t i)
+                                            { return draws[i] < median; }) -
+                       order.begin();
+        size_t lower = upper;
+
+        std::vector<uint32_t> folded;
+        folded.reserve(n_total);
+        while (lower > 0 || upper < n_total)
+        {
+            if (upper == n_total || (lower > 0 && median - draws[order[lower - 1]] <= draws[order[upper]] - median))
+                folded.push_back(order[--lower]);
+            else
+                folded.push_back(order[upper++]);
+        }
+        return folded;
+    }
+
+    // 1 based ranks, tied draws share their average rank. value(i) is the key order sorts draw i by
+    template <typename Value>
+    inline void AverageRanks(const std::vector<uint32_t> &order, const Value &value, double *ranks)
+    {
+        const size_t n_total = order.size();
+        for (size_t start = 0; start < n_total;)
+        {
+            size_t end = start + 1;
+            while (end < n_total && value(order[end]) == value(order[start]))
+                ++end;
+
+            const double rank = 0.5 * double(start + 1 + end);
+            for (size_t i = start; i < end; ++i)
+                ranks[order[i]] = rank;
+            start = end;
+        }
+    }
+
+    // Blom's normal scores, Phi^-1((r - 3/8) / (S + 1/4))
+    inline double NormalScore(double rank, size_t n_total)
+    {
+        return TMath::NormQuantile((rank - 0.375) / (n_total + 0.25));
+    }
+
+    // R's default (type 7) quantile
+    inline double Quantile(const double *draws, const std::vector<uint32_t> &order, double probability)
+    {
+        const double h = (order.size() - 1) * probability;
+        const size_t lo = size_t(std::floor(h));
+        const size_t hi = std::min(lo + 1, order.size() - 1);
+        return draws[order[lo]] + (h - lo) * (draws[order[hi]] - draws[order[lo]]);
+    }
+
+    // Global order of every draw, each chain sorted in parallel before the merge
+    inline std::vector<uint32_t> SortDraws(const std::vector<double> &draws, size_t n_chains, size_t n_draws,
+                                           ROOT::TThreadExecutor &pool)
+    {
+        std::vector<uint32_t> chain_orders(draws.size());
+        pool.Foreach([&](unsigned int chain)
+                     { SortChain(draws.data(), chain, n_draws, chain_orders.data()); },
+                     ROOT::TSeqU(n_chains));
+        return MergeChains(draws.data(), chain_orders, n_chains, n_draws);
+    }
+
+    // Chains
+    class ChainSet
+    {
+    public:
+        // Scans every chain in parallel, files without a posteriors tree are skipped. Needs ROOT::EnableThreadSafety()
+        ChainSet(const std::vector<TString> &chain_files, int step_cut, ROOT::TThreadExecutor &pool)
+            : step_cut_(step_cut)
+        {
+            std::vector<Chain> chains(chain_files.size());
+            std::vector<std::string> errors(chain_files.size());
+            pool.Foreach([&](unsigned int i)
+                         {
+                try
+                {
+                    chains[i] = ScanChain(chain_files[i].Data());
+                }
+                catch (const std::exception &e)
+                {
+                    errors[i] = e.what();
+                } },
+                         ROOT::TSeqU(chain_files.size()));
+
+            for (size_t i = 0; i < chains.size(); ++i)
+            {
+                if (!errors[i].empty())
+                {
+                    std::cerr << "WARNING::Skipping " << chain_files[i] << ": " << errors[i] << std::endl;
+                    continue;
+                }
+                chains_.push_back(std::move(chains[i]));
+            }
+            if (chains_.size() < 2)
+            {
+                throw std::runtime_error("Need at least two chains, found " + std::to_string(chains_.size()));
+            }
+
+            // Parameters in every chain, in the first chain's order
+            std::unordered_map<std::string, size_t> counts;
+            n_draws_ = std::numeric_limits<size_t>::max();
+            for (const auto &chain : chains_)
+            {
+                for (const auto &name : chain.names)
+                    counts[name]++;
+                n_draws_ = std::min(n_draws_, chain.n_draws);
+            }
+            for (const auto &name : chains_[0].names)
+            {
+                if (counts[name] == chains_.size())
+                    parameter_names_.push_back(name);
+                else
+                    std::cerr << "WARNING::" << name << " isn't in every chain, skipping" << std::endl;
+            }
+
+            // Both halves of the split chains the same length
+            n_draws_ -= n_draws_ % 2;
+            if (n_draws_ < 8)
+            {
+                throw std::runtime_error("Shortest chain only has " + std::to_string(n_draws_) + " draws after the step cut");
+            }
+            if (parameter_names_.empty())
+            {
+                throw std::runtime_error("No parameters common to every chain");
+            }
+            if (GetNChains() * n_draws_ > std::numeric_limits<uint32_t>::max())
+            {
+                throw std::runtime_error("Too many draws to rank, raise the step cut");
+            }
+        }
+
+        size_t GetNChains() const { return chains_.size(); }
+        size_t GetNDraws() const { return n_draws_; }
+        const std::vector<std::string> &GetParameterNames() const { return parameter_names_; }
+        const std::string &GetPath(size_t chain) const { return chains_[chain].path; }
+
+        // First GetNDraws() post step cut draws of every chain, one vector per parameter with the chains in order
+        std::vector<std::vector<double>> ReadParameters(const std::vector<std::string> &names, ROOT::TThreadExecutor &pool) const
+        {
+            std::vector<std::vector<double>> draws(names.size(), std::vector<double>(GetNChains() * n_draws_));
+            std::vector<std::string> errors(GetNChains());
+            pool.Foreach([&](unsigned int chain)
+                         {
+                try
+                {
+                    ReadChain(chain, names, draws);
+                }
+                catch (const std::exception &e)
+                {
+                    errors[chain] = e.what();
+                } },
+                         ROOT::TSeqU(GetNChains()));
+
+            for (size_t chain = 0; chain < GetNChains(); ++chain)
+            {
+                if (!errors[chain].empty())
+                {
+                    throw std::runtime_error("Could not read " + chains_[chain].path + ": " + errors[chain]);
+                }
+            }
+            return draws;
+        }
+
+    private:
+        struct Chain
+        {
+            std::string path;
+            std::unique_ptr<ChainColumns::ColumnFile> columns; // Only if convert_chain.C wrote an up to date one
+            std::vector<std::string> names;
+            size_t n_draws = 0;
+        };
+
+        static std::unique_ptr<TFile> OpenPosteriors(const std::string &path, TTree *&posteriors)
+        {
+            std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+            if (!file || file->IsZombie())
+            {
+                throw std::runtime_error("Could not open file");
+            }
+
+            posteriors = nullptr;
+            file->GetObject("posteriors", posteriors);
+            if (!posteriors)
+            {
+                throw std::runtime_error("posteriors tree not found");
+            }
+            return file;
+        }
+
+        // Entries with step > step_cut, the same cut as every other macro
+        std::pair<uint64_t, uint64_t> GetColumnRange(const ChainColumns::ColumnFile &columns) const
+        {
+            return columns.GetEntryRange(int64_t(step_cut_) + 1, std::numeric_limits<int64_t>::max());
+        }
+
+        Chain ScanChain(const std::string &path) const
+        {
+            Chain chain;
+            chain.path = path;
+            chain.columns = ChainColumns::ColumnFile::OpenFor(path);
+            if (chain.columns)
+            {
+                const auto range = GetColumnRange(*chain.columns);
+                chain.names = chain.columns->GetNames();
+                chain.n_draws = range.second - range.first;
+                return chain;
+            }
+
+            TTree *posteriors = nullptr;
+            auto file = OpenPosteriors(path, posteriors);
+            chain.names = AutoCorrelationEngine::GetParameterBranches(posteriors);
+
+            // Only the step branch is decompressed
+            int step = 0;
+            posteriors->SetBranchStatus("*", false);
+            posteriors->SetBranchStatus("step", true);
+            posteriors->SetBranchAddress("step", &step);
+            for (Long64_t entry = 0; entry < posteriors->GetEntries(); ++entry)
+            {
+                posteriors->GetEntry(entry);
+                chain.n_draws += step > step_cut_;
+            }
+            posteriors->ResetBranchAddresses();
+            return chain;
+        }
+
+        void ReadChain(size_t chain_index, const std::vector<std::string> &names, std::vector<std::vector<double>> &draws) const
+        {
+            const Chain &chain = chains_[chain_index];
+            const size_t offset = chain_index * n_draws_;
+            if (chain.columns)
+            {
+                const uint64_t first = GetColumnRange(*chain.columns).first;
+                for (size_t i = 0; i < names.size(); ++i)
+                {
+                    const int index = chain.columns->Find(names[i]);
+                    if (const double *column = chain.columns->GetColumn<double>(index))
+                        std::copy(column + first, column + first + n_draws_, draws[i].begin() + offset);
+                    else if (const float *column = chain.columns->GetColumn<float>(index))
+                        std::copy(column + first, column + first + n_draws_, draws[i].begin() + offset);
+                }
+                return;
+            }
+
+            TTree *posteriors = nullptr;
+            auto file = OpenPosteriors(chain.path, posteriors);
+            auto columns = AutoCorrelationEngine::ReadColumns(posteriors, names, step_cut_);
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                std::copy(columns[i].begin(), columns[i].begin() + n_draws_, draws[i].begin() + offset);
+            }
+        }
+
+        int step_cut_;
+        std::vector<Chain> chains_;
+        std::vector<std::string> parameter_names_;
+        size_t n_draws_ = 0;
+    };
+
+    // Main processing function
+    // Roughly what one parameter costs per draw while it's being ranked: the draws, their sort orders,
+    // both sets of normal scores and an indicator series for the tail ESS
+    constexpr size_t kBytesPerDraw = 48;
+
+    // Parameters are processed in batches that fit in memory_mb. Within a batch chains are read and
+    // sorted in parallel, then the merges, normal scores and ESS run in parallel over parameters
+    inline std::vector<ParameterConvergence> ProcessChains(const ChainSet &chains, ROOT::TThreadExecutor &pool, size_t memory_mb = 4096)
+    {
+        const std::vector<std::string> &parameter_names = chains.GetParameterNames();
+        const size_t n_chains = chains.GetNChains();
+        const size_t n_draws = chains.GetNDraws();
+        const size_t n_total = n_chains * n_draws;
+        const size_t memory_bytes = memory_mb * 1024 * 1024;
+        const size_t parameter_bytes = std::max<size_t>(n_total, 1) * kBytesPerDraw;
+        if (parameter_bytes > memory_bytes)
+        {
+            std::cerr << "WARNING::One parameter over " << n_chains << " chains of " << n_draws << " draws needs about "
+                      << double(parameter_bytes) / (1024 * 1024) << " MB, more than memory_mb = " << memory_mb
+                      << ", processing one parameter at a time" << std::endl;
+        }
+        const size_t batch_size = std::clamp<size_t>(memory_bytes / parameter_bytes, 1, std::max<size_t>(parameter_names.size(), 1));
+
+        std::vector<ParameterConvergence> results(parameter_names.size());
+        for (size_t batch_start = 0; batch_start < parameter_names.size(); batch_start += batch_size)
+        {
+            const size_t batch_end = std::min(batch_start + batch_size, parameter_names.size());
+            const size_t n_batch = batch_end - batch_start;
+            std::vector<std::string> batch_names(parameter_names.begin() + batch_start, parameter_names.begin() + batch_end);
+
+            std::cout << "Processing parameters " << batch_start << " -> " << batch_end << " of " << parameter_names.size()
+                      << " over " << n_chains << " chains" << std::endl;
+            std::vector<std::vector<double>> draws;
+            {
+                Benchmark::ScopedStage stage("read");
+                draws = chains.ReadParameters(batch_names, pool);
+            }
+
+            Benchmark::ScopedStage stage("compute");
+
+            // Every chain of every parameter sorted on its own
+            std::vector<std::vector<uint32_t>> chain_orders(n_batch, std::vector<uint32_t>(n_total));
+            pool.Foreach([&](unsigned int task)
+                         {
+                const size_t parameter = task / n_chains;
+                SortChain(draws[parameter].data(), task % n_chains, n_draws, chain_orders[parameter].data()); },
+                         ROOT::TSeqU(n_batch * n_chains));
+
+            // Merged, then ranks of x and of |x - median|
+            std::vector<std::vector<double>> bulk(n_batch), tail(n_batch);
+            pool.Foreach([&](unsigned int parameter)
+                         {
+                const double *x = draws[parameter].data();
+                ParameterConvergence &result = results[batch_start + parameter];
+                result.name = batch_names[parameter];
+
+                std::vector<uint32_t> order = MergeChains(x, chain_orders[parameter], n_chains, n_draws);
+                std::vector<uint32_t>().swap(chain_orders[parameter]);
+
+                result.q05 = Quantile(x, order, 0.05);
+                result.median = Quantile(x, order, 0.5);
+                result.q95 = Quantile(x, order, 0.95);
+
+                result.mean = std::accumulate(x, x + n_total, 0.0) / n_total;
+                double sum_sq = 0;
+                for (size_t i = 0; i < n_total; ++i)
+                    sum_sq += (x[i] - result.mean) * (x[i] - result.mean);
+                result.sd = std::sqrt(sum_sq / (n_total - 1));
+
+                bulk[parameter].resize(n_total);
+                AverageRanks(order, [x](uint32_t i)
+                             { return x[i]; }, bulk[parameter].data());
+
+                const double median = result.median;
+                order = FoldedOrder(x, order, median);
+                tail[parameter].resize(n_total);
+                AverageRanks(order, [x, median](uint32_t i)
+                             { return std::abs(x[i] - median); }, tail[parameter].data()); },
+                         ROOT::TSeqU(n_batch));
+
+            // Ranks to normal scores, chain by chain
+            pool.Foreach([&](unsigned int task)
+                         {
+                const size_t parameter = task / n_chains;
+                const size_t offset = (task % n_chains) * n_draws;
+                for (size_t i = offset; i < offset + n_draws; ++i)
+                {
+                    bulk[parameter][i] = NormalScore(bulk[parameter][i], n_total);
+                    tail[parameter][i] = NormalScore(tail[parameter][i], n_total);
+                } },
+                         ROOT::TSeqU(n_batch * n_chains));
+
+            // R-hat and ESS on the half chains, the lower and upper tail ESS as their own tasks
+            const size_t n_halves = 2 * n_chains;
+            const size_t half_draws = n_draws / 2;
+            std::vector<double> lower_ess(n_batch), upper_ess(n_batch);
+            pool.Foreach([&](unsigned int task)
+                         {
+                const size_t parameter = task / 3;
+                const double *x = draws[parameter].data();
+                ParameterConvergence &result = results[batch_start + parameter];
+
+                if (task % 3 == 0)
+                {
+                    result.split_rhat = RHat(x, n_halves, half_draws);
+                    result.bulk_rhat = RHat(bulk[parameter].data(), n_halves, half_draws);
+                    result.tail_rhat = RHat(tail[parameter].data(), n_halves, half_draws);
+                    result.rank_rhat = std::max(result.bulk_rhat, result.tail_rhat);
+                    result.bulk_ess = EffectiveSampleSize(bulk[parameter].data(), n_halves, half_draws);
+                    return;
+                }
+
+                const double quantile = task % 3 == 1 ? result.q05 : result.q95;
+                std::vector<double> indicator(n_total);
+                for (size_t i = 0; i < n_total; ++i)
+                    indicator[i] = x[i] <= quantile;
+                (task % 3 == 1 ? lower_ess : upper_ess)[parameter] = EffectiveSampleSize(indicator.data(), n_halves, half_draws); },
+                         ROOT::TSeqU(3 * n_batch));
+
+            for (size_t parameter = 0; parameter < n_batch; ++parameter)
+            {
+                results[batch_start + parameter].tail_ess = std::min(lower_ess[parameter], upper_ess[parameter]);
+            }
+        }
+
+        return results;
+    }
+
+    // Output functions
+    // Worst rank_rhat first, parameters with no R-hat (fixed in every chain) last
+    inline void SortByRHat(std::vector<ParameterConvergence> &results)
+    {
+        auto key = [](const ParameterConvergence &result)
+        {
+            return std::isnan(result.rank_rhat) ? -std::numeric_limits<double>::infinity() : result.rank_rhat;
+        };
+        std::stable_sort(results.begin(), results.end(), [&](const ParameterConvergence &a, const ParameterConvergence &b)
+                         { return key(a) > key(b); });
+    }
+
+    inline void WriteSummaryTree(TFile *output_file, const std::vector<ParameterConvergence> &results,
+                                 size_t n_chains, size_t n_draws)
+    {
+        output_file->cd();
+        TTree *summary = new TTree("convergence_summary", "Multi-chain convergence diagnostics");
+        ParameterConvergence row;
+        int chains = n_chains;
+        Long64_t draws = n_draws;
+        summary->Branch("name", &row.name);
+        summary->Branch("n_chains", &chains, "n_chains/I");
+        summary->Branch("n_draws", &draws, "n_draws/L");
+        summary->Branch("mean", &row.mean, "mean/D");
+        summary->Branch("sd", &row.sd, "sd/D");
+        summary->Branch("q05", &row.q05, "q05/D");
+        summary->Branch("median", &row.median, "median/D");
+        summary->Branch("q95", &row.q95, "q95/D");
+        summary->Branch("split_rhat", &row.split_rhat, "split_rhat/D");
+        summary->Branch("bulk_rhat", &row.bulk_rhat, "bulk_rhat/D");
+        summary->Branch("tail_rhat", &row.tail_rhat, "tail_rhat/D");
+        summary->Branch("rank_rhat", &row.rank_rhat, "rank_rhat/D");
+        summary->Branch("bulk_ess", &row.bulk_ess, "bulk_ess/D");
+        summary->Branch("tail_ess", &row.tail_ess, "tail_ess/D");
+
+        for (const auto &result : results)
+        {
+            row = result;
+            summary->Fill();
+        }
+        summary->Write();
+        delete summary;
+    }
+
+    // Plain CSV, one row per parameter in the order given
+    inline void WriteSummaryTable(const std::string &path, const std::vector<ParameterConvergence> &results)
+    {
+        std::ofstream table(path);
+        if (!table)
+        {
+            throw std::runtime_error("Could not open output file: " + path);
+        }
+
+        table << "name,mean,sd,q05,median,q95,split_rhat,bulk_rhat,tail_rhat,rank_rhat,bulk_ess,tail_ess\n";
+        table.precision(8);
+        for (const auto &result : results)
+        {
+            table << result.name << ',' << result.mean << ',' << result.sd << ',' << result.q05 << ','
+                  << result.median << ',' << result.q95 << ',' << result.split_rhat << ',' << result.bulk_rhat << ','
+                  << result.tail_rhat << ',' << result.rank_rhat << ',' << result.bulk_ess << ',' << result.tail_ess << '\n';
+        }
+    }
+
+} // namespace ConvergenceDiagnostics
@@ -0,0 +1,490 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstdio>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <TROOT.h>
+#include <TSystem.h>
+#include <TString.h>
+#include <TFile.h>
+#include <TTree.h>
+
+#include "diagnostic_macros.h"
+#include "benchmark.h"
+#include "synthetic_chains.h"
+#include "convergence_diagnostics.h"
+#include "sidecar_file.h"
+#include "chain_columns.h"
+
+// Benchmarks the macros on synthetic AR(1) chains and writes a JSON report. Every case runs in its own
+// forked process so peak RSS and ROOT's global state belong to that case alone, and each case reports
+// wall time, bytes read, major faults and peak RSS for the whole case and for each of its open, read,
+// compute and render stages. Cases producing autocorrelations are also checked against phi^k, and the
+// multi-chain diagnostics against the analytic ESS of independent, already converged chains.
+//
+// Usage: diag_benchmark <work_dir> [report.json] [n_steps] [n_parameters] [n_files] [n_threads]
+// The chains in work_dir are reused while they match the requested size, the sidecars are always
+// removed first so cached cases are measured both cold and warm.
+namespace BenchmarkDriver
+{
+
+    struct Config
+    {
+        std::string work_dir;
+        std::string report;
+        SyntheticChains::ChainSpec spec;
+        int n_files = 4;
+        int n_threads = 1;
+        int max_lag = 25000;
+        unsigned int seed = 1234;
+    };
+
+    struct Case
+    {
+        std::string name;
+        std::function<void()> run;
+        std::function<bool()> check; // Untimed, may call Recorder::AddCheck, false if the case gave wrong results
+    };
+
+    struct CaseResult
+    {
+        std::string json; // Empty if the case didn't run
+        bool passed = false;
+    };
+
+    std::string GetChainPath(const Config &config, int file)
+    {
+        return config.work_dir + "/synthetic_chain_" + std::to_string(file) + ".root";
+    }
+
+    std::string GetDiagPath(const Config &config, int file)
+    {
+        return config.work_dir + "/synthetic_chain_" + std::to_string(file) + "_MCMC_Diag.root";
+    }
+
+    std::string GetOutputPath(const Config &config, const std::string &name)
+    {
+        return config.work_dir + "/outputs/" + name;
+    }
+
+    // Setup
+    bool ChainsMatch(const Config &config)
+    {
+        for (int i = 0; i < config.n_files; ++i)
+        {
+            if (gSystem->AccessPathName(GetDiagPath(config, i).c_str()))
+                return false;
+
+            std::unique_ptr<TFile> file(TFile::Open(GetChainPath(config, i).c_str()));
+            if (!file || file->IsZombie())
+                return false;
+
+            TTree *posteriors = nullptr, *truth = nullptr;
+            file->GetObject("posteriors", posteriors);
+            file->GetObject("synthetic_truth", truth);
+            if (!posteriors || !truth || posteriors->GetEntries() != config.spec.n_steps ||
+                truth->GetEntries() != config.spec.n_parameters)
+                return false;
+        }
+        return true;
+    }
+
+    void RemoveSidecars(const Config &config)
+    {
+        for (int i = 0; i < config.n_files; ++i)
+        {
+            for (const auto &path : {GetChainPath(config, i), GetDiagPath(config, i)})
+            {
+                SidecarFile::SourceIdentity identity;
+                if (!SidecarFile::GetSourceIdentity(path, identity))
+                    continue;
+                for (const char *extension : {".summary", ".trace_lod", ".columns"})
+                    std::remove(SidecarFile::GetSidecarPath(identity, extension).c_str());
+            }
+        }
+        gSystem->Unlink(GetOutputPath(config, "incremental_diag_checkpoint.root").c_str());
+    }
+
+    // Checks
+    // Passes if every parameter is within 5 sigma of phi^k, and within rounding of the reference output if there is one
+    bool CheckAutoCorrelations(const Config &config, const std::string &output, const std::string &reference = "")
+    {
+        std::unique_ptr<TFile> file(TFile::Open(output.c_str()));
+        if (!file || file->IsZombie())
+        {
+            throw std::runtime_error("Could not open output file: " + output);
+        }
+        const auto results = AutoCorrelationEngine::ReadResults(file.get());
+
+        // Chain 0 is the one every single chain case runs on
+        SyntheticChains::ChainSpec spec = config.spec;
+        spec.seed = config.seed;
+        const auto validation = SyntheticChains::ValidateAutoCorrelations(spec, results);
+
+        auto &recorder = Benchmark::Recorder::Get();
+        recorder.AddCheck("n_parameters", results.size());
+        recorder.AddCheck("max_acf_deviation", validation.max_acf_deviation);
+        recorder.AddCheck("max_acf_pull", validation.max_acf_pull);
+        recorder.AddCheck("max_time_relative_error", validation.max_time_relative_error);
+        recorder.AddCheck("max_time_pull", validation.max_time_pull);
+        recorder.AddCheck("n_failed", validation.n_failed);
+        bool passed = validation.n_failed == 0 && results.size() == size_t(config.spec.n_parameters);
+
+        // A fast path should agree with the path it replaces to rounding
+        if (!reference.empty())
+        {
+            std::unique_ptr<TFile> reference_file(TFile::Open(reference.c_str()));
+            if (!reference_file || reference_file->IsZombie())
+            {
+                throw std::runtime_error("Could not open reference file: " + reference);
+            }
+            const auto reference_results = AutoCorrelationEngine::ReadResults(reference_file.get());
+
+            double max_difference = 0;
+            for (size_t i = 0; i < std::min(results.size(), reference_results.size()); ++i)
+            {
+                const auto &acf = results[i].autocorrelation;
+                const auto &reference_acf = reference_results[i].autocorrelation;
+                for (size_t lag = 0; lag < std::min(acf.size(), reference_acf.size()); ++lag)
+                    max_difference = std::max(max_difference, std::abs(acf[lag] - reference_acf[lag]));
+            }
+            recorder.AddCheck("max_difference_from_reference", max_difference);
+            passed &= reference_results.size() == results.size() && max_difference < 1e-6;
+        }
+        return passed;
+    }
+
+    // The synthetic chains start at step 0, so an open ended step window has to cover every entry
+    bool CheckColumnRange(const Config &config, const std::string &chain)
+    {
+        auto columns = ChainColumns::ColumnFile::OpenFor(chain);
+        if (!columns)
+        {
+            throw std::runtime_error("No up to date chain columns for: " + chain);
+        }
+
+        const auto range = columns->GetEntryRange(0, std::numeric_limits<int64_t>::max());
+        const auto full_range = columns->GetEntryRange(std::numeric_limits<int64_t>::lowest(), std::numeric_limits<int64_t>::max());
+        const size_t n_read = columns->ReadColumns({SyntheticChains::GetParameterName(0)}, -1)[0].size();
+
+        auto &recorder = Benchmark::Recorder::Get();
+        recorder.AddCheck("first_step", columns->GetSteps()[0]);
+        recorder.AddCheck("open_range_entries", range.second - range.first);
+        recorder.AddCheck("read_entries", n_read);
+        return columns->GetSteps()[0] == 0 && range.first == 0 && range.second == columns->GetNEntries() &&
+               full_range == range && n_read == uint64_t(config.spec.n_steps);
+    }
+
+    // The chains differ only in their seed, so every parameter should pass the R-hat cut and its bulk ESS should be
+    // within 5 sigma of M N / tau, using the same Sokal error as the single chain checks
+    bool CheckConvergence(const Config &config, const std::string &output)
+    {
+        std::unique_ptr<TFile> file(TFile::Open(output.c_str()));
+        if (!file || file->IsZombie())
+        {
+            throw std::runtime_error("Could not open output file: " + output);
+        }
+
+        TTree *summary = nullptr;
+        file->GetObject("convergence_summary", summary);
+        if (!summary)
+        {
+            throw std::runtime_error("convergence_summary tree not found in file: " + output);
+        }
+
+        std::string *name = nullptr;
+        int n_chains = 0;
+        Long64_t n_draws = 0;
+        double rank_rhat = 0, bulk_ess = 0;
+        summary->SetBranchAddress("name", &name);
+        summary->SetBranchAddress("n_chains", &n_chains);
+        summary->SetBranchAddress("n_draws", &n_draws);
+        summary->SetBranchAddress("rank_rhat", &rank_rhat);
+        summary->SetBranchAddress("bulk_ess", &bulk_ess);
+
+        double max_rhat = 0, max_ess_pull = 0, max_ess_relative_error = 0;
+        int n_failed = 0;
+        for (Long64_t entry = 0; entry < summary->GetEntries(); ++entry)
+        {
+            summary->GetEntry(entry);
+            int parameter = -1;
+            for (int i = 0; i < config.spec.n_parameters; ++i)
+            {
+                if (SyntheticChains::GetParameterName(i) == *name)
+                    parameter = i;
+            }
+            if (parameter < 0)
+            {
+                n_failed++;
+                continue;
+            }
+
+            const double n_total = double(n_chains) * n_draws;
+            const double true_time = SyntheticChains::AnalyticIntegratedTime(SyntheticChains::GetPhi(config.spec, parameter));
+            const double true_ess = n_total / true_time;
+            const double ess_error = true_ess * std::sqrt(2 * (2 * 5 * true_time + 1) / n_total);
+            const double ess_deviation = std::abs(bulk_ess - true_ess);
+
+            max_rhat = std::max(max_rhat, rank_rhat);
+            max_ess_pull = std::max(max_ess_pull, ess_deviation / ess_error);
+            max_ess_relative_error = std::max(max_ess_relative_error, ess_deviation / true_ess);
+            n_failed += !(rank_rhat < ConvergenceDiagnostics::kRHatThreshold) || ess_deviation > 5 * ess_error;
+        }
+
+        auto &recorder = Benchmark::Recorder::Get();
+        recorder.AddCheck("n_parameters", summary->GetEntries());
+        recorder.AddCheck("max_rank_rhat", max_rhat);
+        recorder.AddCheck("max_bulk_ess_pull", max_ess_pull);
+        recorder.AddCheck("max_bulk_ess_relative_error", max_ess_relative_error);
+        recorder.AddCheck("n_failed", n_failed);
+        return n_failed == 0 && summary->GetEntries() == config.spec.n_parameters;
+    }
+
+    std::vector<Case> GetCases(const Config &config)
+    {
+        const std::string chain_1 = GetChainPath(config, 0);
+        const std::string chain_2 = GetChainPath(config, std::min(1, config.n_files - 1));
+        const std::string diag_pattern = config.work_dir + "/synthetic_chain_*_MCMC_Diag.root";
+        const std::string chain_pattern = config.work_dir + "/synthetic_chain_*[0-9].root";
+        const int threads = config.n_threads;
+        const int max_lag = std::min<Long64_t>(config.max_lag, config.spec.n_steps - 1);
+
+        std::vector<Case> cases;
+        auto add = [&cases](const std::string &name, std::function<void()> run, std::function<bool()> check = nullptr)
+        {
+            cases.push_back({name, run, check});
+        };
+
+        const std::string ac_tree = GetOutputPath(config, "ac_tree.root");
+        const std::string ac_columns = GetOutputPath(config, "ac_columns.root");
+        const std::string ac_incremental = GetOutputPath(config, "incremental_diag.root");
+        const std::string checkpoint = GetOutputPath(config, "incremental_diag_checkpoint.root");
+
+        // Autocorrelations, the tree path has to run before the chain is converted
+        add("autocorrelation_engine_tree", [=]
+            { autocorrelation_engine(chain_1, ac_tree, max_lag, 0, 64, threads, 4096); },
+            [=]
+            { return CheckAutoCorrelations(config, ac_tree); });
+        add("convert_chain", [=]
+            { convert_chain(chain_1, "", false, 0); });
+        add("autocorrelation_engine_columns", [=]
+            { autocorrelation_engine(chain_1, ac_columns, max_lag, 0, 64, threads, 4096); },
+            [=]
+            {
+                const bool range_passed = CheckColumnRange(config, chain_1);
+                return CheckAutoCorrelations(config, ac_columns, ac_tree) && range_passed; });
+        add("incremental_diag", [=]
+            { incremental_diag(chain_1, ac_incremental, max_lag, 0, 1000, 100000, threads, checkpoint); },
+            [=]
+            { return CheckAutoCorrelations(config, ac_incremental, ac_tree); });
+        add("incremental_diag_no_new_entries", [=]
+            { incremental_diag(chain_1, ac_incremental, max_lag, 0, 1000, 100000, threads, checkpoint); });
+
+        // Posteriors
+        add("compare_posteriors_tree", [=]
+            { compare_posteriors(chain_1, "A", false, chain_2, "B", false, GetOutputPath(config, "posteriors_tree.pdf"), threads, false); });
+        add("compare_posteriors_cache_cold", [=]
+            { compare_posteriors(chain_1, "A", false, chain_2, "B", false, GetOutputPath(config, "posteriors_cold.pdf"), threads, true); });
+        add("compare_posteriors_cache_warm", [=]
+            { compare_posteriors(chain_1, "A", false, chain_2, "B", false, GetOutputPath(config, "posteriors_warm.pdf"), threads, true); });
+
+        // Traces
+        add("compare_trace_plot_cold", [=]
+            { CompareTracePlots(chain_1, "A", chain_2, "B", GetOutputPath(config, "traces_cold.pdf"), 1000, 0, -1); });
+        add("compare_trace_plot_warm", [=]
+            { CompareTracePlots(chain_1, "A", chain_2, "B", GetOutputPath(config, "traces_warm.pdf"), 1000, 0, -1); });
+
+        // _MCMC_Diag files, both sides read the same set so it's the reading that's measured
+        add("plot_average_ac_folder_tree", [=]
+            { plot_average_ac_folder(diag_pattern, "A", diag_pattern, "B", GetOutputPath(config, "ac_folder_tree"), true, false, true, threads, false); });
+        add("plot_average_ac_folder_cache_cold", [=]
+            { plot_average_ac_folder(diag_pattern, "A", diag_pattern, "B", GetOutputPath(config, "ac_folder_cold"), true, false, true, threads, true); });
+        add("plot_average_ac_folder_cache_warm", [=]
+            { plot_average_ac_folder(diag_pattern, "A", diag_pattern, "B", GetOutputPath(config, "ac_folder_warm"), true, false, true, threads, true); });
+        add("plot_diag", [=]
+            { plot_diag(GetDiagPath(config, 0), GetOutputPath(config, "plot_diag")); });
+
+        // Every chain together, chain 0 through its columns and the rest through their trees
+        if (config.n_files > 1)
+        {
+            const std::string multi_chain = GetOutputPath(config, "multi_chain_diag");
+            add("multi_chain_diag", [=]
+                { multi_chain_diag(chain_pattern, multi_chain, 0, 5, 4096, threads); },
+                [=]
+                { return CheckConvergence(config, multi_chain + ".root"); });
+        }
+
+        return cases;
+    }
+
+    // Running
+    // Runs the case in a child process. It exits with 2 if it ran but failed its checks
+    CaseResult RunCase(const Config &config, const Case &benchmark_case)
+    {
+        const std::string result_path = GetOutputPath(config, "." + benchmark_case.name + ".json");
+        std::remove(result_path.c_str());
+
+        std::cout << "Running " << benchmark_case.name << std::endl;
+        std::cout.flush();
+        std::cerr.flush();
+
+        const pid_t pid = fork();
+        if (pid < 0)
+        {
+            throw std::runtime_error("Could not start " + benchmark_case.name);
+        }
+        if (pid == 0)
+        {
+            int status = 0;
+            try
+            {
+                gROOT->SetBatch(true);
+                auto &recorder = Benchmark::Recorder::Get();
+                recorder.StartCase(benchmark_case.name);
+                benchmark_case.run();
+                recorder.StopCase();
+
+                const bool passed = !benchmark_case.check || benchmark_case.check();
+                recorder.AddCheck("passed", passed);
+
+                std::ofstream result(result_path);
+                result << recorder.ToJSON() << std::endl;
+                status = !result ? 1 : passed ? 0 : 2;
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error in " << benchmark_case.name << ": " << e.what() << std::endl;
+                status = 1;
+            }
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(status);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 2))
+        {
+            std::cerr << "FAILED " << benchmark_case.name << std::endl;
+            return {};
+        }
+
+        CaseResult case_result;
+        case_result.passed = WEXITSTATUS(status) == 0;
+        if (!case_result.passed)
+        {
+            std::cerr << "FAILED checks in " << benchmark_case.name << std::endl;
+        }
+
+        std::ifstream result(result_path);
+        std::stringstream json;
+        json << result.rdbuf();
+        std::remove(result_path.c_str());
+
+        case_result.json = json.str();
+        case_result.json.erase(case_result.json.find_last_not_of(" \n") + 1);
+        return case_result;
+    }
+
+    // Returns the number of cases that failed to run or failed their checks
+    int RunBenchmarks(const Config &config)
+    {
+        gSystem->mkdir((config.work_dir + "/outputs").c_str(), true);
+
+        std::vector<CaseResult> results;
+        if (!ChainsMatch(config))
+        {
+            Case generate{"make_synthetic_chains", [&config]
+                          { make_synthetic_chains(config.work_dir, config.n_files, config.spec.n_parameters, config.spec.n_steps,
+                                                  config.spec.phi_min, config.spec.phi_max, config.max_lag, config.seed, true); },
+                          nullptr};
+            results.push_back(RunCase(config, generate));
+            if (!results.back().passed)
+            {
+                throw std::runtime_error("Could not generate synthetic chains in " + config.work_dir);
+            }
+        }
+        RemoveSidecars(config);
+
+        int n_failed = 0;
+        for (const auto &benchmark_case : GetCases(config))
+        {
+            results.push_back(RunCase(config, benchmark_case));
+            n_failed += !results.back().passed;
+        }
+
+        std::ofstream report(config.report);
+        report << "{\"n_steps\": " << config.spec.n_steps
+               << ", \"n_parameters\": " << config.spec.n_parameters
+               << ", \"n_files\": " << config.n_files
+               << ", \"n_threads\": " << config.n_threads
+               << ", \"phi_min\": " << config.spec.phi_min
+               << ", \"phi_max\": " << config.spec.phi_max
+               << ", \"cases\": [\n";
+        bool first = true;
+        for (const auto &result : results)
+        {
+            if (result.json.empty())
+                continue;
+            report << (first ? "  " : ",\n  ") << result.json;
+            first = false;
+        }
+        report << "\n]}" << std::endl;
+        if (!report)
+        {
+            throw std::runtime_error("Could not write report: " + config.report);
+        }
+
+        std::cout << results.size() << " cases written to " << config.report << ", " << n_failed << " failed" << std::endl;
+        return n_failed;
+    }
+
+} // namespace BenchmarkDriver
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <work_dir> [report.json] [n_steps] [n_parameters] [n_files] [n_threads]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        BenchmarkDriver::Config config;
+        config.work_dir = argv[1];
+        config.report = argc > 2 ? argv[2] : config.work_dir + "/benchmark.json";
+        if (argc > 3)
+            config.spec.n_steps = std::stoll(argv[3]);
+        if (argc > 4)
+            config.spec.n_parameters = std::stoi(argv[4]);
+        if (argc > 5)
+            config.n_files = std::stoi(argv[5]);
+        if (argc > 6)
+            config.n_threads = std::stoi(argv[6]);
+
+        if (config.spec.n_steps < 2 || config.spec.n_parameters < 1 || config.n_files < 1)
+        {
+            throw std::invalid_argument("Need at least 2 steps, 1 parameter and 1 file");
+        }
+
+        return BenchmarkDriver::RunBenchmarks(config) == 0 ? 0 : 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
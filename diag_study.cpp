@@ -0,0 +1,490 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <TROOT.h>
+#include <TSystem.h>
+#include <TString.h>
+
+#include "diagnostic_macros.h"
+#include "summary_cache.h"
+#include "file_search.h"
+
+// Runs a whole comparison study from one manifest. Every input is summarised once (into its summary
+// cache) before anything that needs it runs, and independent jobs run in parallel worker processes so
+// ROOT's (non thread-safe) plotting state is never shared.
+//
+// Manifest lines, # starts a comment and "quoted strings" may contain spaces:
+//   workers <n>                    Number of jobs run at once (default: number of cores)
+//   threads_per_job <n>            Implicit MT threads inside each job (default: 1)
+//   study <name> <output_dir>      Following outputs are relative to output_dir
+//   file <id> <path> <label> [nova]
+//   group <name> <id> <id> ...
+//   posteriors <id> <id> <output>
+//   diag_comp <id> <id> <output>
+//   ac_comp <pattern> <label> <pattern> <label> <output>
+//   multi_chain <pattern> <output> [step_cut]   R-hat and ESS across every matching chain
+//   pairwise <posteriors|diag_comp> <group> <output_suffix>
+// Redefining a file id replaces it for every line after, so each study can reuse the same ids.
+namespace StudyDriver
+{
+
+    struct InputFile
+    {
+        std::string path;
+        std::string label;
+        bool nova = false;
+    };
+
+    enum class JobType
+    {
+        Load,
+        Posteriors,
+        DiagComp,
+        ACComp,
+        MultiChain
+    };
+
+    enum class JobState
+    {
+        Waiting,
+        Running,
+        Done,
+        Failed,
+        Skipped
+    };
+
+    struct Job
+    {
+        JobType type;
+        std::string description;
+        std::vector<std::string> args;
+        bool nova_1 = false;
+        bool nova_2 = false;
+        std::vector<size_t> dependencies;
+        std::vector<size_t> dependents;
+        size_t n_pending = 0;
+        JobState state = JobState::Waiting;
+    };
+
+    struct Study
+    {
+        unsigned int n_workers = 0;
+        int threads_per_job = 1;
+        std::vector<Job> jobs;
+        std::map<std::string, size_t> load_jobs; // Path -> job
+    };
+
+    // Manifest parsing
+    std::vector<std::string> Tokenise(const std::string &line)
+    {
+        std::vector<std::string> tokens;
+        std::string token;
+        bool in_quotes = false, has_token = false;
+
+        for (char c : line)
+        {
+            if (c == '"')
+            {
+                in_quotes = !in_quotes;
+                has_token = true;
+            }
+            else if (c == '#' && !in_quotes)
+            {
+                break;
+            }
+            else if (std::isspace(static_cast<unsigned char>(c)) && !in_quotes)
+            {
+                if (has_token)
+                    tokens.push_back(token);
+                token.clear();
+                has_token = false;
+            }
+            else
+            {
+                token += c;
+                has_token = true;
+            }
+        }
+        if (has_token)
+            tokens.push_back(token);
+
+        return tokens;
+    }
+
+    size_t AddLoadJob(Study &study, const std::string &path)
+    {
+        auto existing = study.load_jobs.find(path);
+        if (existing != study.load_jobs.end())
+        {
+            return existing->second;
+        }
+
+        Job job;
+        job.type = JobType::Load;
+        job.description = "Summarise " + path;
+        job.args = {path};
+        study.jobs.push_back(job);
+        study.load_jobs[path] = study.jobs.size() - 1;
+        return study.jobs.size() - 1;
+    }
+
+    void AddJob(Study &study, Job job, const std::vector<std::string> &inputs)
+    {
+        for (const auto &path : inputs)
+        {
+            job.dependencies.push_back(AddLoadJob(study, path));
+        }
+        study.jobs.push_back(job);
+    }
+
+    Study ParseManifest(const std::string &manifest_path)
+    {
+        std::ifstream manifest(manifest_path);
+        if (!manifest)
+        {
+            throw std::runtime_error("Could not open manifest: " + manifest_path);
+        }
+
+        Study study;
+        std::map<std::string, InputFile> files;
+        std::map<std::string, std::vector<std::string>> groups;
+        std::string output_dir;
+
+        auto get_file = [&files](const std::string &id)
+        {
+            auto file = files.find(id);
+            if (file == files.end())
+            {
+                throw std::runtime_error("Unknown file id: " + id);
+            }
+            return file->second;
+        };
+
+        auto output_path = [&output_dir](const std::string &output)
+        {
+            const std::string path = (output_dir.empty() || output[0] == '/') ? output : output_dir + "/" + output;
+            gSystem->mkdir(gSystem->GetDirName(path.c_str()), true);
+            return path;
+        };
+
+        auto add_comparison = [&](const std::string &type, const std::string &id_1, const std::string &id_2, const std::string &output)
+        {
+            const InputFile file_1 = get_file(id_1);
+            const InputFile file_2 = get_file(id_2);
+
+            Job job;
+            job.args = {file_1.path, file_1.label, file_2.path, file_2.label, output_path(output)};
+            job.nova_1 = file_1.nova;
+            job.nova_2 = file_2.nova;
+            job.description = type + " " + id_1 + " vs " + id_2 + " -> " + job.args[4];
+
+            if (type == "posteriors")
+            {
+                job.type = JobType::Posteriors;
+                AddJob(study, job, {file_1.path, file_2.path});
+            }
+            else if (type == "diag_comp")
+            {
+                // Draws the full traces so there's nothing to summarise up front
+                job.type = JobType::DiagComp;
+                AddJob(study, job, {});
+            }
+            else
+            {
+                throw std::runtime_error("Unknown comparison: " + type);
+            }
+        };
+
+        std::string line;
+        int line_number = 0;
+        while (std::getline(manifest, line))
+        {
+            ++line_number;
+            const auto tokens = Tokenise(line);
+            if (tokens.empty())
+                continue;
+
+            const std::string &command = tokens[0];
+            auto require = [&](size_t n_args)
+            {
+                if (tokens.size() < n_args + 1)
+                {
+                    throw std::runtime_error(manifest_path + ":" + std::to_string(line_number) + " " + command +
+                                             " needs " + std::to_string(n_args) + " arguments");
+                }
+            };
+
+            if (command == "workers")
+            {
+                require(1);
+                study.n_workers = std::stoi(tokens[1]);
+            }
+            else if (command == "threads_per_job")
+            {
+                require(1);
+                study.threads_per_job = std::stoi(tokens[1]);
+            }
+            else if (command == "study")
+            {
+                require(2);
+                output_dir = tokens[2];
+                gSystem->mkdir(output_dir.c_str(), true);
+            }
+            else if (command == "file")
+            {
+                require(3);
+                files[tokens[1]] = {tokens[2], tokens[3], tokens.size() > 4 && tokens[4] == "nova"};
+            }
+            else if (command == "group")
+            {
+                require(2);
+                groups[tokens[1]] = std::vector<std::string>(tokens.begin() + 2, tokens.end());
+            }
+            else if (command == "posteriors" || command == "diag_comp")
+            {
+                require(3);
+                add_comparison(command, tokens[1], tokens[2], tokens[3]);
+            }
+            else if (command == "pairwise")
+            {
+                require(3);
+                auto group = groups.find(tokens[2]);
+                if (group == groups.end())
+                {
+                    throw std::runtime_error("Unknown group: " + tokens[2]);
+                }
+                const auto &ids = group->second;
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    for (size_t j = i + 1; j < ids.size(); ++j)
+                    {
+                        add_comparison(tokens[1], ids[i], ids[j], ids[i] + "_" + ids[j] + "_" + tokens[3]);
+                    }
+                }
+            }
+            else if (command == "ac_comp")
+            {
+                require(5);
+                Job job;
+                job.type = JobType::ACComp;
+                job.args = {tokens[1], tokens[2], tokens[3], tokens[4], output_path(tokens[5])};
+                job.description = "ac_comp " + tokens[2] + " vs " + tokens[4] + " -> " + job.args[4];
+
+                std::vector<std::string> inputs;
+                for (const auto &pattern : {tokens[1], tokens[3]})
+                {
+                    for (const auto &path : FileSearch::FindFilesWithWildcard(pattern))
+                    {
+                        inputs.push_back(path.Data());
+                    }
+                }
+                AddJob(study, job, inputs);
+            }
+            else if (command == "multi_chain")
+            {
+                require(2);
+                Job job;
+                job.type = JobType::MultiChain;
+                job.args = {tokens[1], output_path(tokens[2]), tokens.size() > 3 ? tokens[3] : "100000"};
+                job.description = "multi_chain " + tokens[1] + " -> " + job.args[1];
+
+                // Reads the chains themselves, nothing to summarise first
+                AddJob(study, job, {});
+            }
+            else
+            {
+                throw std::runtime_error(manifest_path + ":" + std::to_string(line_number) + " unknown command " + command);
+            }
+        }
+
+        // Wire up the graph
+        for (size_t i = 0; i < study.jobs.size(); ++i)
+        {
+            study.jobs[i].n_pending = study.jobs[i].dependencies.size();
+            for (size_t dependency : study.jobs[i].dependencies)
+            {
+                study.jobs[dependency].dependents.push_back(i);
+            }
+        }
+
+        return study;
+    }
+
+    // Job running, only ever called in a forked worker
+    int RunJob(const Job &job, int threads_per_job)
+    {
+        gROOT->SetBatch(true);
+        if (threads_per_job != 1)
+        {
+            ROOT::EnableImplicitMT(threads_per_job);
+        }
+
+        const auto &args = job.args;
+        try
+        {
+            switch (job.type)
+            {
+            case JobType::Load:
+                SummaryCache::LoadOrBuild(args[0]);
+                break;
+            case JobType::Posteriors:
+                compare_posteriors(args[0], args[1], job.nova_1, args[2], args[3], job.nova_2, args[4], threads_per_job, true);
+                break;
+            case JobType::DiagComp:
+                plot_diag_comp(args[0], args[1], args[2], args[3], args[4]);
+                break;
+            case JobType::ACComp:
+                plot_average_ac_folder(args[0], args[1], args[2], args[3], args[4], true, false, true, threads_per_job, true);
+                break;
+            case JobType::MultiChain:
+                multi_chain_diag(args[0], args[1], std::stoi(args[2]), 10, 4096, threads_per_job);
+                break;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error in " << job.description << ": " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    void SkipDependents(Study &study, size_t failed)
+    {
+        for (size_t dependent : study.jobs[failed].dependents)
+        {
+            if (study.jobs[dependent].state == JobState::Waiting)
+            {
+                study.jobs[dependent].state = JobState::Skipped;
+                SkipDependents(study, dependent);
+            }
+        }
+    }
+
+    // Runs every job once its inputs are ready, keeping up to n_workers processes busy.
+    // Returns the number of jobs that failed or were skipped
+    int RunStudy(Study &study)
+    {
+        const unsigned int n_workers = study.n_workers > 0 ? study.n_workers : std::max(1u, std::thread::hardware_concurrency());
+
+        std::deque<size_t> ready;
+        for (size_t i = 0; i < study.jobs.size(); ++i)
+        {
+            if (study.jobs[i].n_pending == 0)
+                ready.push_back(i);
+        }
+
+        std::map<pid_t, size_t> running;
+        while (!ready.empty() || !running.empty())
+        {
+            while (running.size() < n_workers && !ready.empty())
+            {
+                const size_t index = ready.front();
+                ready.pop_front();
+                Job &job = study.jobs[index];
+                if (job.state != JobState::Waiting)
+                    continue;
+
+                std::cout << "Starting " << job.description << std::endl;
+                std::cout.flush();
+                std::cerr.flush();
+
+                const pid_t pid = fork();
+                if (pid < 0)
+                {
+                    throw std::runtime_error("Could not start worker for " + job.description);
+                }
+                if (pid == 0)
+                {
+                    const int status = RunJob(job, study.threads_per_job);
+                    std::cout.flush();
+                    std::cerr.flush();
+                    _exit(status);
+                }
+
+                job.state = JobState::Running;
+                running[pid] = index;
+            }
+
+            if (running.empty())
+                break;
+
+            int status = 0;
+            const pid_t pid = waitpid(-1, &status, 0);
+            auto finished = running.find(pid);
+            if (finished == running.end())
+                continue;
+
+            const size_t index = finished->second;
+            running.erase(finished);
+            Job &job = study.jobs[index];
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            {
+                job.state = JobState::Done;
+                std::cout << "Finished " << job.description << std::endl;
+                for (size_t dependent : job.dependents)
+                {
+                    if (--study.jobs[dependent].n_pending == 0)
+                        ready.push_back(dependent);
+                }
+            }
+            else
+            {
+                job.state = JobState::Failed;
+                std::cerr << "FAILED " << job.description << std::endl;
+                SkipDependents(study, index);
+            }
+        }
+
+        int n_done = 0, n_failed = 0, n_skipped = 0;
+        for (const auto &job : study.jobs)
+        {
+            n_done += job.state == JobState::Done;
+            n_failed += job.state == JobState::Failed;
+            n_skipped += job.state == JobState::Skipped;
+        }
+        std::cout << n_done << " jobs finished, " << n_failed << " failed, " << n_skipped << " skipped" << std::endl;
+        return n_failed + n_skipped;
+    }
+
+} // namespace StudyDriver
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <manifest> [workers]" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        auto study = StudyDriver::ParseManifest(argv[1]);
+        if (argc > 2)
+        {
+            study.n_workers = std::stoi(argv[2]);
+        }
+
+        std::cout << "Running " << study.jobs.size() << " jobs (" << study.load_jobs.size() << " inputs)" << std::endl;
+        return StudyDriver::RunStudy(study) == 0 ? 0 : 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <TString.h>
+#include <RtypesCore.h>
+
+// Entry points of the macros built into libDiagnosticMacros. Defaults live with the definitions
+// in each macro so they still work from the ROOT prompt, callers of the library pass everything
+
+void compare_posteriors(TString file_1_name, TString file_1_lab, bool file_1_nova, TString file_2_name, TString file_2_lab, bool file_2_nova,
+                        TString output, int n_threads, bool use_cache);
+
+void CompareTracePlots(TString file_1_name, TString file_1_lab, TString file_2_name, TString file_2_lab, TString output,
+                       int n_points, Long64_t step_lo, Long64_t step_hi);
+
+void plot_average_ac(TString diagfile, TString output);
+
+void plot_average_ac_mult(TString file_1, TString label_1, TString file_2, TString label_2, TString output_name);
+
+void plot_average_ac_folder(const TString &folder1, const TString &label1,
+                            const TString &folder2, const TString &label2,
+                            const TString &output_name,
+                            bool draw_min_max,
+                            bool draw_all,
+                            bool draw_errors,
+                            int n_threads,
+                            bool use_cache);
+
+void plot_diag(TString diagfile, TString output);
+
+void plot_diag_comp(TString input_file_1, TString file_1_label, TString input_file_2, TString file_2_label, TString output);
+
+void autocorrelation_engine(const TString &chain_file,
+                            const TString &output_name,
+                            int max_lag,
+                            int step_cut,
+                            int batch_size,
+                            int n_threads,
+                            int memory_mb);
+
+void incremental_diag(const TString &chain_file,
+                      const TString &output_name,
+                      int max_lag,
+                      int step_cut,
+                      int trace_bin_size,
+                      Long64_t block_size,
+                      int n_threads,
+                      TString checkpoint_name);
+
+void convert_chain(const TString &chain_file,
+                   const TString &output_name,
+                   bool single_precision,
+                   int burn_in);
+
+void make_synthetic_chains(const TString &output_dir,
+                           int n_files,
+                           int n_parameters,
+                           Long64_t n_steps,
+                           double phi_min,
+                           double phi_max,
+                           int max_lag,
+                           unsigned int seed,
+                           bool write_diag);
+
+void multi_chain_diag(const TString &chain_pattern,
+                      const TString &output_name,
+                      int step_cut,
+                      int n_worst,
+                      int memory_mb,
+                      int n_threads);
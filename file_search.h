@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+
+#include <fnmatch.h>
+
+#include <TString.h>
+#include <TList.h>
+#include <TSystemDirectory.h>
+#include <TSystemFile.h>
+
+// Shell style wildcard matching over paths, every path component may contain * ? or [...]
+namespace FileSearch
+{
+
+    inline bool HasWildcard(const TString &part)
+    {
+        return part.First('*') != kNPOS || part.First('?') != kNPOS || part.First('[') != kNPOS;
+    }
+
+    // Files the diagnostics write next to their inputs (SidecarFile::GetSidecarPath, convert_chain), and their
+    // .tmp<pid> names while being written. A pattern like *Diag* would match them otherwise
+    inline bool IsSidecarFile(const TString &file_name)
+    {
+        const std::string name = file_name.Data();
+        for (const std::string extension : {".summary", ".trace_lod", ".columns"})
+        {
+            if (name.size() >= extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0)
+                return true;
+        }
+
+        const size_t dot = name.find_last_of('.');
+        return dot != std::string::npos && name.compare(dot, 4, ".tmp") == 0 &&
+               std::all_of(name.begin() + dot + 4, name.end(), [](char c)
+                           { return std::isdigit(static_cast<unsigned char>(c)) != 0; });
+    }
+
+    inline void FindMatchingFilesRecursive(const TString &base_dir,
+                                           const std::vector<TString> &pattern_parts,
+                                           size_t current_part_index,
+                                           std::vector<TString> &result_files)
+    {
+        if (current_part_index >= pattern_parts.size())
+            return;
+
+        TSystemDirectory dir(base_dir, base_dir);
+        std::unique_ptr<TList> entries(dir.GetListOfFiles());
+        if (!entries)
+            return;
+
+        TIter next(entries.get());
+        TSystemFile *entry;
+        const TString &current_pattern = pattern_parts[current_part_index];
+
+        while ((entry = dynamic_cast<TSystemFile *>(next())))
+        {
+            TString name = entry->GetName();
+            if (name == "." || name == "..")
+                continue;
+
+            if (fnmatch(current_pattern.Data(), name.Data(), 0) != 0)
+                continue;
+
+            TString full_path = base_dir + "/" + name;
+            full_path.ReplaceAll("//", "/");
+
+            if (current_part_index == pattern_parts.size() - 1)
+            {
+                if (!entry->IsDirectory() && !IsSidecarFile(name))
+                {
+                    result_files.push_back(full_path);
+                }
+            }
+            else
+            {
+                if (entry->IsDirectory())
+                {
+                    FindMatchingFilesRecursive(full_path, pattern_parts, current_part_index + 1, result_files);
+                }
+            }
+        }
+    }
+
+    // Matching files in name order, leaving out sidecars
+    inline std::vector<TString> FindFilesWithWildcard(const TString &full_pattern)
+    {
+        std::vector<TString> pattern_parts;
+        TString token;
+        Ssiz_t from = 0;
+
+        while (full_pattern.Tokenize(token, from, "/"))
+        {
+            if (!token.IsNull())
+            {
+                pattern_parts.push_back(token);
+            }
+        }
+
+        if (pattern_parts.empty())
+        {
+            return {};
+        }
+
+        // Leading components without wildcards are just the directory to start from
+        TString base_dir = full_pattern.BeginsWith("/") ? "/" : ".";
+        while (pattern_parts.size() > 1 && !HasWildcard(pattern_parts[0]))
+        {
+            base_dir += (base_dir.EndsWith("/") ? "" : "/") + pattern_parts[0];
+            pattern_parts.erase(pattern_parts.begin());
+        }
+        if (base_dir.BeginsWith("./"))
+        {
+            base_dir.Remove(0, 2);
+        }
+
+        std::vector<TString> matching_files;
+        FindMatchingFilesRecursive(base_dir, pattern_parts, 0, matching_files);
+        std::sort(matching_files.begin(), matching_files.end());
+        return matching_files;
+    }
+
+} // namespace FileSearch
@@ -1,3 +1,5 @@
+import os
+import struct
 import uproot
 import pandas as pd
 import numpy as np
@@ -5,6 +7,113 @@ from typing import Sequence
 from matplotlib import pyplot as plt
 from matplotlib.backends.backend_pdf import PdfPages
 import tqdm
+from chain_columns import ChainColumnsReader
+from sidecar_file import sidecar_path
+
+class TracePyramidReader:
+    '''
+    Reads the <chain>.trace_lod min/max/mean pyramid written by trace_pyramid.h
+    Layout must match TracePyramid::FileHeader and TracePyramid::ParameterRecord
+    '''
+    _header = struct.Struct("<8sIIQqQIIQQ")
+    _record = struct.Struct("<QIIQ")
+
+    def __init__(self, pyramid_path: str)->None:
+        self._data = np.memmap(pyramid_path, dtype=np.uint8, mode="r")
+        (magic, version, n_parameters, self.source_size, self.source_mtime,
+         self.n_entries, self.block_size, n_levels, steps_offset, records_offset) = self._header.unpack_from(self._data, 0)
+
+        if magic != b"DMTRACE\0" or version != 2:
+            raise ValueError(f"{pyramid_path} is not a trace pyramid")
+
+        self._level_sizes = []
+        n_buckets = -(-self.n_entries // self.block_size)
+        while n_buckets > 0:
+            self._level_sizes.append(n_buckets)
+            if n_buckets == 1:
+                break
+            n_buckets = -(-n_buckets // 2)
+
+        if len(self._level_sizes) != n_levels:
+            raise ValueError(f"{pyramid_path} has inconsistent levels")
+
+        n_base = self._level_sizes[0] if self._level_sizes else 0
+        self._first_steps = np.frombuffer(self._data, dtype="<i8", count=n_base, offset=steps_offset)
+        self._last_steps = np.frombuffer(self._data, dtype="<i8", count=n_base, offset=steps_offset + 8 * n_base)
+
+        self._records = {}
+        for i in range(n_parameters):
+            name_offset, name_length, _, data_offset = self._record.unpack_from(self._data, records_offset + i * self._record.size)
+            name = bytes(self._data[name_offset:name_offset + name_length]).decode()
+            self._records[name] = data_offset
+
+    @classmethod
+    def open_for(cls, chain_path: str):
+        '''
+        Pyramid for the chain, wherever trace_pyramid.h put it, if it exists and is still up to date with it, otherwise None
+        '''
+        source = os.path.realpath(chain_path)
+        pyramid_path = sidecar_path(source, ".trace_lod")
+        if not os.path.exists(pyramid_path):
+            return None
+
+        try:
+            reader = cls(pyramid_path)
+        except (ValueError, struct.error):
+            return None
+
+        info = os.stat(source)
+        if reader.source_size != info.st_size or reader.source_mtime != info.st_mtime_ns:
+            return None
+        return reader
+
+    def __contains__(self, param: str)->bool:
+        return param in self._records
+
+    def query(self, param: str, step_lo: int, step_hi: int, n_points: int):
+        '''
+        At most n_points buckets covering [step_lo, step_hi] from the finest level that fits
+        :return: steps, minima, maxima and means of each bucket
+        '''
+        first = int(np.searchsorted(self._last_steps, step_lo, side="left"))
+        last = int(np.searchsorted(self._first_steps, step_hi, side="right"))
+        if first >= last:
+            return tuple(np.empty(0) for _ in range(4))
+
+        level = 0
+        while level + 1 < len(self._level_sizes) and ((last - 1) >> level) - (first >> level) + 1 > n_points:
+            level += 1
+
+        n_level = self._level_sizes[level]
+        level_offset = self._records[param] + 8 * 4 * sum(self._level_sizes[:level])
+        arrays = np.frombuffer(self._data, dtype="<f8", count=4 * n_level, offset=level_offset).reshape(4, n_level)
+
+        # Buckets where every entry was cut are left out, as in TracePyramid::PyramidFile::Query
+        buckets = np.arange(first >> level, ((last - 1) >> level) + 1)
+        buckets = buckets[arrays[3, buckets] > 0]
+        base_first = buckets << level
+        base_last = np.minimum(((buckets + 1) << level) - 1, len(self._first_steps) - 1)
+        steps = 0.5 * (self._first_steps[base_first] + self._last_steps[base_last])
+        return steps, arrays[0, buckets], arrays[1, buckets], arrays[2, buckets]
+
+
+def decimate_trace(steps: np.ndarray, values: np.ndarray, n_points: int):
+    '''
+    Min/max/mean of n_points equal buckets, used when there's no pyramid for the chain
+    '''
+    if len(values) == 0:
+        return tuple(np.empty(0) for _ in range(4))
+
+    bucket_size = max(1, -(-len(values) // n_points))
+    edges = np.arange(0, len(values), bucket_size)
+    counts = np.diff(np.append(edges, len(values)))
+
+    bucket_steps = 0.5 * (steps[edges] + steps[edges + counts - 1])
+    return (bucket_steps,
+            np.minimum.reduceat(values, edges),
+            np.maximum.reduceat(values, edges),
+            np.add.reduceat(values, edges) / counts)
+
 
 class RootTreeHandler:
     def __init__(self, file_path: str, label: str, step_cut: int, tree_name: str="posteriors")->None:
@@ -12,10 +121,19 @@ class RootTreeHandler:
         Constructor for RootFileHandler class.
         :param file_path: Path to the ROOT file.
         '''
+        self._label = label
+        self._step_cut = step_cut
+        self._pyramid = TracePyramidReader.open_for(file_path) if tree_name == "posteriors" else None
+
+        # Converted chains are mapped one parameter at a time rather than loaded whole
+        self._columns = ChainColumnsReader.open_for(file_path) if tree_name == "posteriors" else None
+        if self._columns is not None:
+            print(f"Mapping {file_path} columns...")
+            self.stored_tree = None
+            return
+
         print(f"Loading {file_path}...")
         ttree_ = uproot.open(file_path+f":{tree_name}")
-        self._label = label
-        
         self.stored_tree = ttree_.arrays(library="pd", cut=f"step>{step_cut}")
     
     @property
@@ -29,15 +147,41 @@ class RootTreeHandler:
         :param step: The step number.
         :return: A list of values for the specified parameter at the given step.
         '''
-        return self.stored_tree[param].values.tolist()
+        return self._get_values(param).tolist()
+
+    def _get_values(self, param: str):
+        '''
+        Post step cut values of a parameter as a numpy array, a view of the mapped file for converted chains.
+        '''
+        if self._columns is not None:
+            return self._columns.get_column(param, step_lo=self._step_cut + 1)[0]
+        return self.stored_tree[param].to_numpy()
+
+    def _get_steps(self):
+        if self._columns is not None:
+            first, last = self._columns.entry_range(self._step_cut + 1, np.iinfo(np.int64).max)
+            return self._columns.steps[first:last]
+        return self.stored_tree["step"].to_numpy()
     
+    def get_trace(self, param: str, n_points: int = 1000):
+        '''
+        Decimated trace of a parameter, reads the trace pyramid when there's an up to date one.
+        :param param: The parameter to retrieve.
+        :param n_points: Maximum number of buckets to return.
+        :return: Steps, minima, maxima and means of each bucket.
+        '''
+        if self._pyramid is not None and param in self._pyramid:
+            return self._pyramid.query(param, self._step_cut + 1, np.iinfo(np.int64).max, n_points)
+
+        return decimate_trace(self._get_steps(), self._get_values(param), n_points)
+
     def get_autocorr_func(self, param: str):
         '''
         Get the autocorrelation of a specific parameter.
         :param param: The parameter to retrieve.
         :return: A list of autocorrelation values for the specified parameter.
         '''
-        param_arr = np.array(self.get_param_vals(param))
+        param_arr = np.asarray(self._get_values(param), dtype=np.float64)
         
         div = np.std(param_arr) * np.sqrt(param_arr)
         
@@ -57,11 +201,13 @@ class RootTreeHandler:
         Get the list of parameters in the tree.
         :return: A list of parameter names.
         '''
+        if self._columns is not None:
+            return self._columns.get_params()
         return self.stored_tree.columns.tolist()
     
     def get_min_max(self, param: str):
-
-        return self.stored_tree[param].min(), self.stored_tree[param].max()
+        values = self._get_values(param)
+        return values.min(), values.max()
 
     def get_posterior_hist(self, param: str, bins: int | Sequence = 100):
         '''
@@ -70,7 +216,7 @@ class RootTreeHandler:
         :param bins: The number of bins for the histogram.
         :return: A list of histogram values for the specified parameter.
         '''
-        hist, bin_edges = np.histogram(self.stored_tree[param], bins=bins)
+        hist, bin_edges = np.histogram(self._get_values(param), bins=bins)
         return hist, bin_edges
     
 class TreeComparitor:
@@ -117,6 +263,15 @@ class TreeComparitor:
         :return: A list of values for the specified parameter at the given step.
         '''
         return self.tree_1.get_param_vals(param), self.tree_2.get_param_vals(param)
+
+    def get_traces(self, param: str, n_points: int = 1000):
+        '''
+        Get the decimated traces of a specific parameter.
+        :param param: The parameter to retrieve.
+        :param n_points: Maximum number of points per trace.
+        :return: Steps, minima, maxima and means for each tree.
+        '''
+        return self.tree_1.get_trace(param, n_points), self.tree_2.get_trace(param, n_points)
     
 class TreePlotter:
     def __init__(self, file_path_1, label_1, file_path_2, label_2, step_cut=0, tree_name="posteriors"):
@@ -129,7 +284,7 @@ class TreePlotter:
         :param param: The parameter to plot.
         '''
         
-        trace_1, trace_2 = self.tree_comparitor.get_param_vals(param)
+        trace_1, trace_2 = self.tree_comparitor.get_traces(param)
         hist_1, bin_edges_1, hist_2, bin_edges_2 = self.tree_comparitor.get_posterior_hists(param)
         autocorr_1, autocorr_2 = self.tree_comparitor.get_autocorr_func(param)
     
@@ -143,8 +298,9 @@ class TreePlotter:
         
         ax_trace = fig.add_subplot(gs[0, 0])
         
-        ax_trace.plot(trace_1, label=self.tree_comparitor.tree_1.label)
-        ax_trace.plot(trace_2, label=self.tree_comparitor.tree_2.label)
+        for (steps, min_, max_, mean), tree in ((trace_1, self.tree_comparitor.tree_1), (trace_2, self.tree_comparitor.tree_2)):
+            line, = ax_trace.plot(steps, mean, label=tree.label)
+            ax_trace.fill_between(steps, min_, max_, color=line.get_color(), alpha=0.3, linewidth=0)
         ax_trace.set_title("Trace")
         ax_trace.set_xlabel("Step")
         ax_trace.set_ylabel(param)
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <TSystem.h>
+
+// Shared bits for the binary files that sit next to a chain: identifying the source file and mapping
+// the sidecar back into memory
+namespace SidecarFile
+{
+
+    struct SourceIdentity
+    {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime = 0; // ns
+    };
+
+    inline bool GetSourceIdentity(const std::string &source_path, SourceIdentity &identity)
+    {
+        char resolved[PATH_MAX];
+        struct stat info;
+        if (!realpath(source_path.c_str(), resolved) || stat(resolved, &info) != 0)
+        {
+            return false;
+        }
+
+        identity.path = resolved;
+        identity.size = info.st_size;
+#ifdef __APPLE__
+        identity.mtime = int64_t(info.st_mtimespec.tv_sec) * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+        identity.mtime = int64_t(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+        return true;
+    }
+
+    // FNV-1a of the resolved path, 16 hex digits. Spelled out rather than std::hash so sidecar_file.py
+    // finds the same temp directory files
+    inline std::string PathHash(const std::string &path)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : path)
+        {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        return hex;
+    }
+
+    // <source><extension> when that directory is writable, otherwise <temp>/<name>.<path hash><extension>
+    inline std::string GetSidecarPath(const SourceIdentity &identity, const std::string &extension)
+    {
+        const std::string directory = identity.path.substr(0, identity.path.find_last_of('/') + 1);
+        if (access(directory.empty() ? "." : directory.c_str(), W_OK) == 0)
+        {
+            return identity.path + extension;
+        }
+
+        const std::string base_name = identity.path.substr(identity.path.find_last_of('/') + 1);
+        return std::string(gSystem->TempDirectory()) + "/" + base_name + "." + PathHash(identity.path) + extension;
+    }
+
+    // Read only mapping of a whole file
+    class MappedFile
+    {
+    public:
+        // Returns nullptr if the file can't be opened or mapped
+        static std::unique_ptr<MappedFile> Open(const std::string &path)
+        {
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return nullptr;
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size == 0)
+            {
+                close(fd);
+                return nullptr;
+            }
+
+            void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED)
+                return nullptr;
+
+            return std::unique_ptr<MappedFile>(new MappedFile(static_cast<const char *>(data), info.st_size));
+        }
+
+        ~MappedFile()
+        {
+            munmap(const_cast<char *>(data_), size_);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const char *GetData() const { return data_; }
+        size_t GetSize() const { return size_; }
+
+        template <typename T>
+        const T *At(uint64_t offset) const
+        {
+            return reinterpret_cast<const T *>(data_ + offset);
+        }
+
+    private:
+        MappedFile(const char *data, size_t size) : data_(data), size_(size) {}
+
+        const char *data_;
+        size_t size_;
+    };
+
+} // namespace SidecarFile
@@ -0,0 +1,35 @@
+import os
+
+
+def path_hash(path: str)->str:
+    '''
+    FNV-1a of a resolved path as 16 hex digits, must match SidecarFile::PathHash in sidecar_file.h
+    :param path: Resolved path of the chain.
+    '''
+    value = 14695981039346656037
+    for byte in path.encode():
+        value = ((value ^ byte) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return f"{value:016x}"
+
+
+def temp_directory()->str:
+    '''
+    Same choice as ROOT's TSystem::TempDirectory on Unix, $TMPDIR if it's writable and /tmp otherwise
+    '''
+    directory = os.environ.get("TMPDIR")
+    if not directory or not os.access(directory, os.W_OK):
+        directory = "/tmp"
+    return directory
+
+
+def sidecar_path(source: str, extension: str)->str:
+    '''
+    Where SidecarFile::GetSidecarPath puts a sidecar: next to the chain when that directory is writable,
+    otherwise <temp>/<name>.<path hash><extension>
+    :param source: Resolved path of the chain.
+    :param extension: Sidecar extension, e.g. ".columns".
+    '''
+    directory, name = os.path.split(source)
+    if os.access(directory or ".", os.W_OK):
+        return source + extension
+    return os.path.join(temp_directory(), f"{name}.{path_hash(source)}{extension}")
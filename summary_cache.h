@@ -0,0 +1,632 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include <unistd.h>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TKey.h>
+#include <TDirectoryFile.h>
+#include <TH1D.h>
+#include <TMath.h>
+#include <TSystem.h>
+#include <TROOT.h>
+#include <ROOT/RDataFrame.hxx>
+#include <ROOT/RDFHelpers.hxx>
+
+#include "sidecar_file.h"
+
+// Per file sidecar (<file>.summary) holding everything the comparison macros need from a chain or
+// _MCMC_Diag file: autocorrelations, ranges, moments and finely binned posteriors. It's a flat
+// binary file so it can be mmapped straight back in, and it's only trusted if the source file's
+// path, size and mtime still match.
+namespace SummaryCache
+{
+
+    // Format
+    constexpr char kMagic[8] = {'D', 'M', 'S', 'U', 'M', 'R', 'Y', '\0'};
+    constexpr uint32_t kVersion = 1;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_parameters;
+        uint64_t source_size;
+        int64_t source_mtime; // ns
+        uint64_t path_offset;
+        uint32_t path_length;
+        int32_t step_cut;
+        uint32_t n_bins;
+        uint32_t reserved;
+        uint64_t records_offset;
+    };
+
+    struct ParameterRecord
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t n_lags;
+        double min_val; // Over every step
+        double max_val;
+        double mean; // After the step cut
+        double variance;
+        uint64_t n_samples;
+        double ac_min; // Lag axis
+        double ac_max;
+        uint64_t ac_offset;
+        double posterior_min;
+        double posterior_max;
+        uint32_t n_posterior_bins;
+        uint32_t n_wrapped_bins; // delta_cp wrapped into [-pi, pi]
+        uint64_t posterior_offset;
+        uint64_t wrapped_offset;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "Summary header layout changed");
+    static_assert(sizeof(ParameterRecord) == 120, "Summary record layout changed");
+
+    // In-memory summary used while building
+    struct ParameterSummary
+    {
+        std::string name;
+        double min_val = 0, max_val = 0, mean = 0, variance = 0;
+        uint64_t n_samples = 0;
+        double ac_min = 0, ac_max = 0;
+        std::vector<double> autocorrelation;
+        double posterior_min = 0, posterior_max = 0;
+        std::vector<double> posterior;
+        std::vector<double> wrapped_posterior;
+    };
+
+    struct Summary
+    {
+        std::string source_path;
+        uint64_t source_size = 0;
+        int64_t source_mtime = 0;
+        int32_t step_cut = 0;
+        uint32_t n_bins = 0;
+        std::vector<ParameterSummary> parameters;
+    };
+
+    using SidecarFile::GetSourceIdentity;
+    using SidecarFile::SourceIdentity;
+
+    inline std::string GetCachePath(const SourceIdentity &identity)
+    {
+        return SidecarFile::GetSidecarPath(identity, ".summary");
+    }
+
+    // Writing
+    inline void WriteSummary(const Summary &summary, const std::string &cache_path)
+    {
+        const uint32_t n_parameters = summary.parameters.size();
+        uint64_t offset = sizeof(FileHeader) + n_parameters * sizeof(ParameterRecord);
+
+        // Lay out the arrays first so every double stays 8 byte aligned, strings go at the end
+        std::vector<ParameterRecord> records(n_parameters);
+        for (uint32_t i = 0; i < n_parameters; ++i)
+        {
+            const ParameterSummary &par = summary.parameters[i];
+            ParameterRecord &record = records[i];
+            std::memset(&record, 0, sizeof(record));
+
+            record.min_val = par.min_val;
+            record.max_val = par.max_val;
+            record.mean = par.mean;
+            record.variance = par.variance;
+            record.n_samples = par.n_samples;
+            record.ac_min = par.ac_min;
+            record.ac_max = par.ac_max;
+            record.posterior_min = par.posterior_min;
+            record.posterior_max = par.posterior_max;
+
+            record.n_lags = par.autocorrelation.size();
+            record.ac_offset = record.n_lags ? offset : 0;
+            offset += record.n_lags * sizeof(double);
+
+            record.n_posterior_bins = par.posterior.size();
+            record.posterior_offset = record.n_posterior_bins ? offset : 0;
+            offset += record.n_posterior_bins * sizeof(double);
+
+            record.n_wrapped_bins = par.wrapped_posterior.size();
+            record.wrapped_offset = record.n_wrapped_bins ? offset : 0;
+            offset += record.n_wrapped_bins * sizeof(double);
+        }
+
+        for (uint32_t i = 0; i < n_parameters; ++i)
+        {
+            records[i].name_offset = offset;
+            records[i].name_length = summary.parameters[i].name.size();
+            offset += records[i].name_length;
+        }
+
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.n_parameters = n_parameters;
+        header.source_size = summary.source_size;
+        header.source_mtime = summary.source_mtime;
+        header.path_offset = offset;
+        header.path_length = summary.source_path.size();
+        header.step_cut = summary.step_cut;
+        header.n_bins = summary.n_bins;
+        header.records_offset = sizeof(FileHeader);
+
+        // Written to a temporary name and moved into place so readers never see half a file
+        const std::string temp_path = cache_path + ".tmp" + std::to_string(getpid());
+        FILE *out = std::fopen(temp_path.c_str(), "wb");
+        if (!out)
+        {
+            throw std::runtime_error("Could not write summary cache: " + temp_path);
+        }
+
+        bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+        if (n_parameters > 0)
+        {
+            ok &= std::fwrite(records.data(), sizeof(ParameterRecord), n_parameters, out) == n_parameters;
+        }
+
+        auto write_array = [&](const std::vector<double> &vals)
+        {
+            if (!vals.empty())
+                ok &= std::fwrite(vals.data(), sizeof(double), vals.size(), out) == vals.size();
+        };
+        for (const auto &par : summary.parameters)
+        {
+            write_array(par.autocorrelation);
+            write_array(par.posterior);
+            write_array(par.wrapped_posterior);
+        }
+        for (const auto &par : summary.parameters)
+        {
+            ok &= std::fwrite(par.name.data(), 1, par.name.size(), out) == par.name.size();
+        }
+        ok &= std::fwrite(summary.source_path.data(), 1, summary.source_path.size(), out) == summary.source_path.size();
+        ok &= std::fclose(out) == 0;
+
+        if (!ok || std::rename(temp_path.c_str(), cache_path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Could not write summary cache: " + cache_path);
+        }
+    }
+
+    // Reading
+    class SummaryFile
+    {
+    public:
+        // Returns nullptr if the file is missing or isn't a valid summary
+        static std::unique_ptr<SummaryFile> Open(const std::string &cache_path)
+        {
+            auto file = SidecarFile::MappedFile::Open(cache_path);
+            if (!file || file->GetSize() < sizeof(FileHeader))
+                return nullptr;
+
+            std::unique_ptr<SummaryFile> summary(new SummaryFile(std::move(file)));
+            if (!summary->IsValid())
+                return nullptr;
+
+            summary->BuildIndex();
+            return summary;
+        }
+
+        SummaryFile(const SummaryFile &) = delete;
+        SummaryFile &operator=(const SummaryFile &) = delete;
+
+        const FileHeader &GetHeader() const { return *file_->At<FileHeader>(0); }
+        size_t GetNParameters() const { return GetHeader().n_parameters; }
+
+        const ParameterRecord &GetRecord(size_t i) const
+        {
+            return file_->At<ParameterRecord>(GetHeader().records_offset)[i];
+        }
+
+        std::string GetName(size_t i) const
+        {
+            return std::string(file_->At<char>(GetRecord(i).name_offset), GetRecord(i).name_length);
+        }
+
+        std::string GetSourcePath() const
+        {
+            return std::string(file_->At<char>(GetHeader().path_offset), GetHeader().path_length);
+        }
+
+        // Arrays point straight into the mapped file, nullptr if not stored
+        const double *GetAutoCorrelation(size_t i) const { return GetArray(GetRecord(i).ac_offset); }
+        const double *GetPosterior(size_t i) const { return GetArray(GetRecord(i).posterior_offset); }
+        const double *GetWrappedPosterior(size_t i) const { return GetArray(GetRecord(i).wrapped_offset); }
+
+        // -1 if the parameter isn't in the summary
+        int Find(const std::string &name) const
+        {
+            auto it = index_.find(name);
+            return it == index_.end() ? -1 : it->second;
+        }
+
+        bool Matches(const SourceIdentity &identity, int step_cut, uint32_t n_bins) const
+        {
+            const FileHeader &header = GetHeader();
+            return header.source_size == identity.size &&
+                   header.source_mtime == identity.mtime &&
+                   header.step_cut == step_cut &&
+                   header.n_bins == n_bins &&
+                   GetSourcePath() == identity.path;
+        }
+
+    private:
+        SummaryFile(std::unique_ptr<SidecarFile::MappedFile> file) : file_(std::move(file)) {}
+
+        const double *GetArray(uint64_t offset) const
+        {
+            return offset ? file_->At<double>(offset) : nullptr;
+        }
+
+        bool IsValid() const
+        {
+            const FileHeader &header = GetHeader();
+            const size_t file_size = file_->GetSize();
+            if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion)
+                return false;
+
+            if (header.records_offset + uint64_t(header.n_parameters) * sizeof(ParameterRecord) > file_size ||
+                header.path_offset + header.path_length > file_size)
+                return false;
+
+            for (size_t i = 0; i < header.n_parameters; ++i)
+            {
+                const ParameterRecord &record = GetRecord(i);
+                if (record.name_offset + record.name_length > file_size ||
+                    record.ac_offset + uint64_t(record.n_lags) * sizeof(double) > file_size ||
+                    record.posterior_offset + uint64_t(record.n_posterior_bins) * sizeof(double) > file_size ||
+                    record.wrapped_offset + uint64_t(record.n_wrapped_bins) * sizeof(double) > file_size)
+                    return false;
+            }
+            return true;
+        }
+
+        void BuildIndex()
+        {
+            for (size_t i = 0; i < GetNParameters(); ++i)
+            {
+                index_[GetName(i)] = i;
+            }
+        }
+
+        std::unique_ptr<SidecarFile::MappedFile> file_;
+        std::unordered_map<std::string, int> index_;
+    };
+
+    // Building
+    inline double WrapDeltaCP(double val)
+    {
+        // NOvA delta_cp lives in [-pi, pi]
+        const double min_val = -1 * TMath::Pi();
+        const double max_val = TMath::Pi();
+        if (val < min_val)
+        {
+            val = 2 * max_val + val;
+        }
+        if (val > max_val)
+        {
+            val = 2 * min_val + val;
+        }
+        return val;
+    }
+
+    inline void AddAutoCorrelations(TFile *file, Summary &summary)
+    {
+        TDirectoryFile *autocor_dir = nullptr;
+        file->GetObject("Auto_corr", autocor_dir);
+        if (!autocor_dir)
+            return;
+
+        TIter next(autocor_dir->GetListOfKeys());
+        TKey *key;
+        while ((key = dynamic_cast<TKey *>(next())))
+        {
+            TH1D *hist = nullptr;
+            autocor_dir->GetObject(key->GetName(), hist);
+            if (!hist)
+                continue;
+
+            ParameterSummary par;
+            par.name = key->GetName();
+            par.ac_min = hist->GetXaxis()->GetXmin();
+            par.ac_max = hist->GetXaxis()->GetXmax();
+            par.autocorrelation.resize(hist->GetNbinsX());
+            for (int bin = 0; bin < hist->GetNbinsX(); ++bin)
+            {
+                par.autocorrelation[bin] = hist->GetBinContent(bin + 1);
+            }
+            summary.parameters.push_back(std::move(par));
+            delete hist;
+        }
+    }
+
+    // One cold summary. The two RDataFrame passes over the posteriors tree (ranges over every step, then the
+    // step cut posteriors and moments) are booked separately, so the same pass of several builders can run
+    // in a single RunGraphs
+    class SummaryBuilder
+    {
+    public:
+        SummaryBuilder(const SourceIdentity &identity, int step_cut, uint32_t n_bins)
+        {
+            summary_.source_path = identity.path;
+            summary_.source_size = identity.size;
+            summary_.source_mtime = identity.mtime;
+            summary_.step_cut = step_cut;
+            summary_.n_bins = n_bins;
+
+            std::unique_ptr<TFile> file(TFile::Open(identity.path.c_str()));
+            if (!file || file->IsZombie())
+            {
+                throw std::runtime_error("Could not open file: " + identity.path);
+            }
+
+            AddAutoCorrelations(file.get(), summary_);
+
+            TTree *posteriors = nullptr;
+            file->GetObject("posteriors", posteriors);
+            if (!posteriors)
+                return;
+
+            TIter next(posteriors->GetListOfBranches());
+            TBranch *branch;
+            while ((branch = dynamic_cast<TBranch *>(next())))
+            {
+                branch_names_.push_back(branch->GetName());
+            }
+            if (!branch_names_.empty())
+            {
+                df_.reset(new ROOT::RDataFrame("posteriors", identity.path));
+            }
+        }
+
+        // First pass, adds one handle to run if there's a posteriors tree
+        void BookRanges(std::vector<ROOT::RDF::RResultHandle> &handles)
+        {
+            if (!df_)
+                return;
+
+            for (const auto &name : branch_names_)
+            {
+                min_vals_.push_back(df_->Min(name));
+                max_vals_.push_back(df_->Max(name));
+            }
+            handles.push_back(min_vals_[0]);
+        }
+
+        // Second pass, needs the ranges to have been run
+        void BookPosteriors(std::vector<ROOT::RDF::RResultHandle> &handles)
+        {
+            if (!df_)
+                return;
+
+            ROOT::RDF::RNode cut_df = df_->Filter("step>" + std::to_string(summary_.step_cut));
+            count_ = cut_df.Count();
+            wrapped_hists_.resize(branch_names_.size());
+
+            for (size_t i = 0; i < branch_names_.size(); ++i)
+            {
+                const std::string &name = branch_names_[i];
+                double min_val = *min_vals_[i];
+                double max_val = *max_vals_[i];
+                if (max_val <= min_val)
+                {
+                    min_val -= 0.5;
+                    max_val += 0.5;
+                }
+
+                posterior_hists_.push_back(cut_df.Histo1D(ROOT::RDF::TH1DModel(name.c_str(), name.c_str(), summary_.n_bins, min_val, max_val), name));
+                means_.push_back(cut_df.Mean(name));
+                std_devs_.push_back(cut_df.StdDev(name));
+
+                if (TString(name).Contains("delta_cp"))
+                {
+                    const std::string wrapped_name = name + "_wrapped";
+                    cut_df = cut_df.Define(wrapped_name, [](double val)
+                                           { return WrapDeltaCP(val); }, {name});
+                    wrapped_hists_[i] = cut_df.Histo1D<double>(ROOT::RDF::TH1DModel(wrapped_name.c_str(), name.c_str(), summary_.n_bins, -1 * TMath::Pi(), TMath::Pi()), wrapped_name);
+                }
+            }
+            handles.push_back(count_);
+        }
+
+        // Once both passes have run
+        Summary Finish()
+        {
+            if (!df_)
+                return std::move(summary_);
+
+            const uint64_t n_samples = *count_;
+            for (size_t i = 0; i < branch_names_.size(); ++i)
+            {
+                ParameterSummary par;
+                par.name = branch_names_[i];
+                par.min_val = *min_vals_[i];
+                par.max_val = *max_vals_[i];
+                par.mean = *means_[i];
+                par.variance = (*std_devs_[i]) * (*std_devs_[i]);
+                par.n_samples = n_samples;
+
+                const TH1D &hist = *posterior_hists_[i];
+                par.posterior_min = hist.GetXaxis()->GetXmin();
+                par.posterior_max = hist.GetXaxis()->GetXmax();
+                par.posterior.resize(hist.GetNbinsX());
+                for (int bin = 0; bin < hist.GetNbinsX(); ++bin)
+                {
+                    par.posterior[bin] = hist.GetBinContent(bin + 1);
+                }
+
+                if (wrapped_hists_[i])
+                {
+                    const TH1D &wrapped = *wrapped_hists_[i];
+                    par.wrapped_posterior.resize(wrapped.GetNbinsX());
+                    for (int bin = 0; bin < wrapped.GetNbinsX(); ++bin)
+                    {
+                        par.wrapped_posterior[bin] = wrapped.GetBinContent(bin + 1);
+                    }
+                }
+                summary_.parameters.push_back(std::move(par));
+            }
+            return std::move(summary_);
+        }
+
+    private:
+        Summary summary_;
+        std::vector<std::string> branch_names_;
+        std::unique_ptr<ROOT::RDataFrame> df_;
+        std::vector<ROOT::RDF::RResultPtr<double>> min_vals_, max_vals_, means_, std_devs_;
+        std::vector<ROOT::RDF::RResultPtr<TH1D>> posterior_hists_, wrapped_hists_;
+        ROOT::RDF::RResultPtr<ULong64_t> count_;
+    };
+
+    // Main interface, maps each file's cached summary if it's still valid and rebuilds it otherwise. Cold files are
+    // built together, one per implicit MT thread at a time, with both passes of a batch run by a single RunGraphs.
+    // Files that can't be summarised come back as nullptr with the reason in errors
+    inline std::vector<std::unique_ptr<SummaryFile>> LoadOrBuild(const std::vector<TString> &source_paths,
+                                                                 std::vector<std::string> &errors,
+                                                                 int step_cut = 100000, uint32_t n_bins = 1000)
+    {
+        std::vector<std::unique_ptr<SummaryFile>> summaries(source_paths.size());
+        std::vector<SourceIdentity> identities(source_paths.size());
+        std::vector<size_t> stale;
+        errors.assign(source_paths.size(), "");
+
+        for (size_t i = 0; i < source_paths.size(); ++i)
+        {
+            if (!GetSourceIdentity(source_paths[i].Data(), identities[i]))
+            {
+                errors[i] = "Could not find file: " + std::string(source_paths[i].Data());
+                continue;
+            }
+
+            summaries[i] = SummaryFile::Open(GetCachePath(identities[i]));
+            if (!summaries[i] || !summaries[i]->Matches(identities[i], step_cut, n_bins))
+            {
+                summaries[i].reset();
+                stale.push_back(i);
+            }
+        }
+
+        const size_t batch_size = std::max(1u, ROOT::GetThreadPoolSize());
+        for (size_t batch_start = 0; batch_start < stale.size(); batch_start += batch_size)
+        {
+            std::vector<size_t> batch;
+            std::vector<std::unique_ptr<SummaryBuilder>> builders;
+            for (size_t j = batch_start; j < std::min(batch_start + batch_size, stale.size()); ++j)
+            {
+                const size_t i = stale[j];
+                std::cout << "Building summary cache for " << source_paths[i] << std::endl;
+                try
+                {
+                    builders.emplace_back(new SummaryBuilder(identities[i], step_cut, n_bins));
+                    batch.push_back(i);
+                }
+                catch (const std::exception &e)
+                {
+                    errors[i] = e.what();
+                }
+            }
+
+            std::vector<ROOT::RDF::RResultHandle> ranges, posteriors;
+            for (auto &builder : builders)
+                builder->BookRanges(ranges);
+            if (!ranges.empty())
+                ROOT::RDF::RunGraphs(ranges);
+            for (auto &builder : builders)
+                builder->BookPosteriors(posteriors);
+            if (!posteriors.empty())
+                ROOT::RDF::RunGraphs(posteriors);
+
+            for (size_t j = 0; j < batch.size(); ++j)
+            {
+                const size_t i = batch[j];
+                const std::string cache_path = GetCachePath(identities[i]);
+                try
+                {
+                    WriteSummary(builders[j]->Finish(), cache_path);
+                    summaries[i] = SummaryFile::Open(cache_path);
+                    if (!summaries[i])
+                    {
+                        errors[i] = "Could not read back summary cache: " + cache_path;
+                    }
+                }
+                catch (const std::exception &e)
+                {
+                    errors[i] = e.what();
+                }
+            }
+        }
+        return summaries;
+    }
+
+    inline std::unique_ptr<SummaryFile> LoadOrBuild(const TString &source_path, int step_cut = 100000, uint32_t n_bins = 1000)
+    {
+        std::vector<std::string> errors;
+        auto summaries = LoadOrBuild(std::vector<TString>{source_path}, errors, step_cut, n_bins);
+        if (!summaries[0])
+        {
+            throw std::runtime_error(errors[0]);
+        }
+        return std::move(summaries[0]);
+    }
+
+    // Puts a cached fine posterior onto the requested axis. Each fine bin is shared between the bins it overlaps
+    // assuming it's flat inside, so it only matches filling from the tree exactly when the bin edges line up
+    inline TH1D *RebinPosterior(const double *fine_counts, int n_fine_bins, double fine_min, double fine_max,
+                                const TString &name, const TString &title, int nbins, double min_val, double max_val)
+    {
+        TH1D *hist = new TH1D(name, title, nbins, min_val, max_val);
+        hist->SetDirectory(nullptr);
+        const double width = (fine_max - fine_min) / double(n_fine_bins);
+        const double coarse_width = (max_val - min_val) / double(nbins);
+
+        // Under and overflow at 0 and nbins+1 as in TH1
+        std::vector<double> contents(nbins + 2, 0.0);
+        double entries = 0;
+        for (int bin = 0; bin < n_fine_bins; ++bin)
+        {
+            if (fine_counts[bin] == 0)
+                continue;
+
+            const double lo = fine_min + bin * width;
+            const double hi = lo + width;
+            const double density = fine_counts[bin] / width;
+            entries += fine_counts[bin];
+
+            if (lo < min_val)
+                contents[0] += density * (std::min(hi, min_val) - lo);
+            if (hi > max_val)
+                contents[nbins + 1] += density * (hi - std::max(lo, max_val));
+
+            const int first = int(std::clamp(std::floor((lo - min_val) / coarse_width), 0.0, double(nbins - 1)));
+            const int last = int(std::clamp(std::floor((hi - min_val) / coarse_width), 0.0, double(nbins - 1)));
+            for (int coarse = first; coarse <= last; ++coarse)
+            {
+                const double overlap = std::min(hi, min_val + (coarse + 1) * coarse_width) - std::max(lo, min_val + coarse * coarse_width);
+                if (overlap > 0)
+                    contents[coarse + 1] += density * overlap;
+            }
+        }
+
+        for (int bin = 0; bin < nbins + 2; ++bin)
+            hist->SetBinContent(bin, contents[bin]);
+        hist->SetEntries(entries);
+        return hist;
+    }
+
+} // namespace SummaryCache
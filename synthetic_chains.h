@@ -0,0 +1,255 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TH1D.h>
+#include <TDirectory.h>
+
+#include "autocorrelation_engine.h"
+
+// MaCh3-like chains made of independent AR(1) parameters, x_t = phi x_(t-1) + sqrt(1 - phi^2) e_t with unit
+// normal e_t, so each parameter is stationary with unit variance and its autocorrelation at lag k is
+// exactly phi^k. Each parameter has its own generator seeded from the file seed, so a parameter's series
+// can be regenerated on its own without holding the whole chain in memory.
+namespace SyntheticChains
+{
+
+    struct ChainSpec
+    {
+        Long64_t n_steps = 200000;
+        int n_parameters = 50;
+        double phi_min = 0.5;
+        double phi_max = 0.99;
+        unsigned int seed = 1234;
+    };
+
+    // Truth
+    // phi spread evenly between phi_min and phi_max
+    inline double GetPhi(const ChainSpec &spec, int parameter)
+    {
+        if (spec.n_parameters <= 1)
+            return spec.phi_min;
+        return spec.phi_min + (spec.phi_max - spec.phi_min) * parameter / double(spec.n_parameters - 1);
+    }
+
+    inline double AnalyticAutoCorrelation(double phi, int lag)
+    {
+        return std::pow(phi, lag);
+    }
+
+    // Sum of phi^|k| over every k
+    inline double AnalyticIntegratedTime(double phi)
+    {
+        return (1.0 + phi) / (1.0 - phi);
+    }
+
+    // Offset so the parameters aren't all centred on zero, purely cosmetic
+    inline double GetMean(int parameter)
+    {
+        return 0.1 * (parameter % 11);
+    }
+
+    inline std::string GetParameterName(int parameter)
+    {
+        return "xsec_" + std::to_string(parameter);
+    }
+
+    // Generation
+    class ParameterGenerator
+    {
+    public:
+        ParameterGenerator(const ChainSpec &spec, int parameter)
+            : phi_(GetPhi(spec, parameter)),
+              innovation_scale_(std::sqrt(1.0 - phi_ * phi_)),
+              mean_(GetMean(parameter))
+        {
+            std::seed_seq seeds{spec.seed, static_cast<unsigned int>(parameter)};
+            engine_.seed(seeds);
+
+            // Start from the stationary distribution so there's no burn-in
+            x_ = normal_(engine_);
+        }
+
+        double Next()
+        {
+            const double value = x_;
+            x_ = phi_ * x_ + innovation_scale_ * normal_(engine_);
+            return mean_ + value;
+        }
+
+    private:
+        double phi_;
+        double innovation_scale_;
+        double mean_;
+        std::mt19937_64 engine_;
+        std::normal_distribution<double> normal_;
+        double x_ = 0;
+    };
+
+    inline std::vector<double> GenerateParameter(const ChainSpec &spec, int parameter)
+    {
+        ParameterGenerator generator(spec, parameter);
+        std::vector<double> series(spec.n_steps);
+        for (auto &value : series)
+            value = generator.Next();
+        return series;
+    }
+
+    // posteriors tree like a MaCh3 chain, plus a synthetic_truth tree with every parameter's phi
+    inline void WritePosteriorFile(const std::string &path, const ChainSpec &spec)
+    {
+        std::unique_ptr<TFile> file(TFile::Open(path.c_str(), "RECREATE"));
+        if (!file || file->IsZombie())
+        {
+            throw std::runtime_error("Could not open output file: " + path);
+        }
+
+        {
+            TTree posteriors("posteriors", "posteriors");
+            int step = 0;
+            std::vector<double> row(spec.n_parameters);
+            std::vector<ParameterGenerator> generators;
+            generators.reserve(spec.n_parameters);
+
+            posteriors.Branch("step", &step, "step/I");
+            for (int i = 0; i < spec.n_parameters; ++i)
+            {
+                const std::string name = GetParameterName(i);
+                posteriors.Branch(name.c_str(), &row[i], (name + "/D").c_str());
+                generators.emplace_back(spec, i);
+            }
+
+            for (step = 0; step < spec.n_steps; ++step)
+            {
+                for (int i = 0; i < spec.n_parameters; ++i)
+                    row[i] = generators[i].Next();
+                posteriors.Fill();
+            }
+            posteriors.Write();
+
+            TTree truth("synthetic_truth", "synthetic_truth");
+            std::string name;
+            double phi = 0, integrated_time = 0;
+            truth.Branch("name", &name);
+            truth.Branch("phi", &phi, "phi/D");
+            truth.Branch("integrated_time", &integrated_time, "integrated_time/D");
+            for (int i = 0; i < spec.n_parameters; ++i)
+            {
+                name = GetParameterName(i);
+                phi = GetPhi(spec, i);
+                integrated_time = AnalyticIntegratedTime(phi);
+                truth.Fill();
+            }
+            truth.Write();
+        }
+        file->Close();
+    }
+
+    // _MCMC_Diag file for the same chain, one bin per step in Trace like MaCh3 and the sample autocorrelations in Auto_corr
+    inline void WriteDiagFile(const std::string &path, const ChainSpec &spec, int max_lag = 25000)
+    {
+        std::unique_ptr<TFile> file(TFile::Open(path.c_str(), "RECREATE"));
+        if (!file || file->IsZombie())
+        {
+            throw std::runtime_error("Could not open output file: " + path);
+        }
+
+        std::vector<AutoCorrelationEngine::ParameterResult> results;
+        TDirectory *trace_dir = file->mkdir("Trace");
+        for (int i = 0; i < spec.n_parameters; i += 2)
+        {
+            // Two parameters per FFT, the same pairing as the engine
+            const bool has_second = i + 1 < spec.n_parameters;
+            std::vector<double> first = GenerateParameter(spec, i);
+            std::vector<double> second = has_second ? GenerateParameter(spec, i + 1) : std::vector<double>();
+
+            for (int j = 0; j < (has_second ? 2 : 1); ++j)
+            {
+                const std::string name = GetParameterName(i + j);
+                const std::vector<double> &series = j == 0 ? first : second;
+                TH1D trace((name + "_Trace").c_str(), name.c_str(), spec.n_steps, 0, spec.n_steps);
+                trace.SetDirectory(nullptr);
+                for (Long64_t step = 0; step < spec.n_steps; ++step)
+                    trace.SetBinContent(step + 1, series[step]);
+                trace_dir->WriteTObject(&trace);
+            }
+
+            auto acfs = AutoCorrelationEngine::AutoCorrelationPair(first, second);
+            results.push_back(AutoCorrelationEngine::SummariseAutoCorrelation(GetParameterName(i), std::move(acfs.first), max_lag));
+            if (has_second)
+                results.push_back(AutoCorrelationEngine::SummariseAutoCorrelation(GetParameterName(i + 1), std::move(acfs.second), max_lag));
+        }
+
+        AutoCorrelationEngine::WriteAutoCorrelationDirectory(file.get(), results);
+        AutoCorrelationEngine::WriteSummaryTree(file.get(), results);
+        file->Close();
+    }
+
+    // Checks
+    struct ValidationResult
+    {
+        double max_acf_deviation = 0;      // Largest |acf - phi^k|
+        double max_acf_pull = 0;           // Same in units of the expected sampling error
+        double max_time_relative_error = 0; // Largest |tau - tau_true| / tau_true
+        double max_time_pull = 0;
+        int n_failed = 0;
+    };
+
+    // Compares sample autocorrelations against phi^k up to 5 integrated times, where they still carry signal.
+    // Errors use Bartlett's large lag variance for AR(1), (1 + phi^2) / ((1 - phi^2) N), and Sokal's
+    // var(tau) ~ 2 (2M + 1) tau^2 / N. A parameter fails if it's more than n_sigma out on either.
+    inline ValidationResult ValidateAutoCorrelations(const ChainSpec &spec,
+                                                     const std::vector<AutoCorrelationEngine::ParameterResult> &results,
+                                                     double n_sigma = 5)
+    {
+        ValidationResult validation;
+        for (const auto &result : results)
+        {
+            int parameter = -1;
+            for (int i = 0; i < spec.n_parameters; ++i)
+            {
+                if (GetParameterName(i) == result.name)
+                    parameter = i;
+            }
+            if (parameter < 0)
+            {
+                validation.n_failed++;
+                continue;
+            }
+
+            const double phi = GetPhi(spec, parameter);
+            const double true_time = AnalyticIntegratedTime(phi);
+            const double n_samples = result.n_samples;
+            const double acf_error = std::sqrt((1.0 + phi * phi) / ((1.0 - phi * phi) * n_samples));
+            const int n_lags = std::min<int>(result.autocorrelation.size(), std::ceil(5 * true_time) + 1);
+
+            bool failed = false;
+            for (int lag = 0; lag < n_lags; ++lag)
+            {
+                const double deviation = std::abs(result.autocorrelation[lag] - AnalyticAutoCorrelation(phi, lag));
+                validation.max_acf_deviation = std::max(validation.max_acf_deviation, deviation);
+                validation.max_acf_pull = std::max(validation.max_acf_pull, deviation / acf_error);
+                failed |= deviation > n_sigma * acf_error;
+            }
+
+            const double window = 5 * true_time;
+            const double time_error = true_time * std::sqrt(2 * (2 * window + 1) / n_samples);
+            const double time_deviation = std::abs(result.integrated_time - true_time);
+            validation.max_time_relative_error = std::max(validation.max_time_relative_error, time_deviation / true_time);
+            validation.max_time_pull = std::max(validation.max_time_pull, time_deviation / time_error);
+            failed |= time_deviation > n_sigma * time_error;
+
+            validation.n_failed += failed;
+        }
+        return validation;
+    }
+
+} // namespace SyntheticChains
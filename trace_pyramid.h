@@ -0,0 +1,467 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TString.h>
+
+#include "autocorrelation_engine.h"
+#include "sidecar_file.h"
+
+// Multi-resolution min/max/mean pyramid of every parameter's trace, stored in a <chain>.trace_lod sidecar.
+// Level 0 summarises blocks of block_size entries and each level above merges pairs of the one below, so
+// drawing any step window only touches about as many buckets as there are points to draw.
+// full_diag.py reads the same layout, keep the two in sync.
+namespace TracePyramid
+{
+
+    // Format
+    constexpr char kMagic[8] = {'D', 'M', 'T', 'R', 'A', 'C', 'E', '\0'};
+    constexpr uint32_t kVersion = 2;
+
+    // Steps where a parameter holds this or more are left out of its buckets, as compare_trace_plot always cut them
+    constexpr double kSentinel = 12345;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_parameters;
+        uint64_t source_size;
+        int64_t source_mtime; // ns
+        uint64_t n_entries;
+        uint32_t block_size;
+        uint32_t n_levels;
+        uint64_t steps_offset; // First then last step of each level 0 bucket, int64
+        uint64_t records_offset;
+    };
+
+    // Each level l holds min[n_l], max[n_l], mean[n_l], count[n_l] back to back, levels one after the other.
+    // count is the number of entries kept below kSentinel, buckets with none are skipped when reading
+    struct ParameterRecord
+    {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t reserved;
+        uint64_t data_offset;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "Trace pyramid header layout changed");
+    static_assert(sizeof(ParameterRecord) == 24, "Trace pyramid record layout changed");
+
+    inline std::vector<uint64_t> GetLevelSizes(uint64_t n_entries, uint32_t block_size)
+    {
+        std::vector<uint64_t> sizes;
+        uint64_t n_buckets = (n_entries + block_size - 1) / block_size;
+        while (n_buckets > 0)
+        {
+            sizes.push_back(n_buckets);
+            if (n_buckets == 1)
+                break;
+            n_buckets = (n_buckets + 1) / 2;
+        }
+        return sizes;
+    }
+
+    // Decimated trace for one window, one point per bucket
+    struct TraceSlice
+    {
+        std::vector<double> step;
+        std::vector<double> min;
+        std::vector<double> max;
+        std::vector<double> mean;
+    };
+
+    // Building
+    // Level 0 is written in chunks of chunk_buckets during one pass over the tree, then each parameter's
+    // coarser levels are built from its level 0 mapped back in, so memory doesn't grow with parameters x buckets
+    inline void BuildPyramid(TTree *tree, const SidecarFile::SourceIdentity &identity, const std::string &output_path,
+                             uint32_t block_size, uint64_t chunk_buckets = 64)
+    {
+        const auto names = AutoCorrelationEngine::GetParameterBranches(tree);
+        const uint64_t n_entries = tree->GetEntries();
+        const auto level_sizes = GetLevelSizes(n_entries, block_size);
+        const uint64_t n_buckets = level_sizes.empty() ? 0 : level_sizes[0];
+        const size_t n_parameters = names.size();
+
+        // Layout
+        uint64_t offset = sizeof(FileHeader) + n_parameters * sizeof(ParameterRecord);
+        const uint64_t steps_offset = offset;
+        offset += 2 * n_buckets * sizeof(int64_t);
+
+        uint64_t values_per_parameter = 0;
+        for (uint64_t size : level_sizes)
+            values_per_parameter += 4 * size;
+
+        std::vector<ParameterRecord> records(n_parameters);
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            std::memset(&records[i], 0, sizeof(ParameterRecord));
+            records[i].data_offset = offset;
+            offset += values_per_parameter * sizeof(double);
+        }
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            records[i].name_offset = offset;
+            records[i].name_length = names[i].size();
+            offset += names[i].size();
+        }
+        const uint64_t file_size = offset;
+
+        const std::string temp_path = output_path + ".tmp" + std::to_string(getpid());
+        const int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not write trace pyramid: " + temp_path);
+        }
+
+        bool ok = ftruncate(fd, file_size) == 0;
+        auto write_at = [&](const void *data, size_t size, uint64_t position)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            while (ok && size > 0)
+            {
+                const ssize_t written = pwrite(fd, bytes, size, position);
+                ok = written > 0;
+                bytes += written;
+                size -= written;
+                position += written;
+            }
+        };
+
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            write_at(names[i].data(), names[i].size(), records[i].name_offset);
+        }
+
+        // Level 0 in one pass over the tree
+        std::vector<double> row(n_parameters);
+        int step = 0;
+        tree->SetBranchStatus("*", false);
+        tree->SetBranchStatus("step", true);
+        tree->SetBranchAddress("step", &step);
+        for (size_t i = 0; i < n_parameters; ++i)
+        {
+            tree->SetBranchStatus(names[i].c_str(), true);
+            tree->SetBranchAddress(names[i].c_str(), &row[i]);
+        }
+
+        std::vector<int64_t> first_steps(n_buckets, 0), last_steps(n_buckets, 0);
+        std::vector<std::vector<double>> mins(n_parameters), maxs(n_parameters), means(n_parameters), counts(n_parameters);
+        for (uint64_t chunk_start = 0; chunk_start < n_buckets && ok; chunk_start += chunk_buckets)
+        {
+            const uint64_t chunk_size = std::min(chunk_buckets, n_buckets - chunk_start);
+            for (size_t i = 0; i < n_parameters; ++i)
+            {
+                mins[i].assign(chunk_size, std::numeric_limits<double>::max());
+                maxs[i].assign(chunk_size, std::numeric_limits<double>::lowest());
+                means[i].assign(chunk_size, 0.0);
+                counts[i].assign(chunk_size, 0.0);
+            }
+
+            for (uint64_t j = 0; j < chunk_size; ++j)
+            {
+                const uint64_t bucket = chunk_start + j;
+                const uint64_t entry_end = std::min<uint64_t>((bucket + 1) * block_size, n_entries);
+                for (uint64_t entry = bucket * block_size; entry < entry_end; ++entry)
+                {
+                    tree->GetEntry(entry);
+                    if (entry == bucket * block_size)
+                        first_steps[bucket] = step;
+                    last_steps[bucket] = step;
+
+                    for (size_t i = 0; i < n_parameters; ++i)
+                    {
+                        if (!(row[i] < kSentinel))
+                            continue;
+                        mins[i][j] = std::min(mins[i][j], row[i]);
+                        maxs[i][j] = std::max(maxs[i][j], row[i]);
+                        means[i][j] += row[i];
+                        counts[i][j] += 1;
+                    }
+                }
+
+                for (size_t i = 0; i < n_parameters; ++i)
+                {
+                    if (counts[i][j] > 0)
+                        means[i][j] /= counts[i][j];
+                }
+            }
+
+            for (size_t i = 0; i < n_parameters; ++i)
+            {
+                const uint64_t position = records[i].data_offset + chunk_start * sizeof(double);
+                write_at(mins[i].data(), chunk_size * sizeof(double), position);
+                write_at(maxs[i].data(), chunk_size * sizeof(double), position + n_buckets * sizeof(double));
+                write_at(means[i].data(), chunk_size * sizeof(double), position + 2 * n_buckets * sizeof(double));
+                write_at(counts[i].data(), chunk_size * sizeof(double), position + 3 * n_buckets * sizeof(double));
+            }
+        }
+        tree->ResetBranchAddresses();
+        tree->SetBranchStatus("*", true);
+
+        write_at(first_steps.data(), n_buckets * sizeof(int64_t), steps_offset);
+        write_at(last_steps.data(), n_buckets * sizeof(int64_t), steps_offset + n_buckets * sizeof(int64_t));
+
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.n_parameters = n_parameters;
+        header.source_size = identity.size;
+        header.source_mtime = identity.mtime;
+        header.n_entries = n_entries;
+        header.block_size = block_size;
+        header.n_levels = level_sizes.size();
+        header.steps_offset = steps_offset;
+        header.records_offset = sizeof(FileHeader);
+
+        write_at(&header, sizeof(header), 0);
+        write_at(records.data(), n_parameters * sizeof(ParameterRecord), header.records_offset);
+
+        // Coarser levels, one parameter at a time, merged means weighted by the kept entries of each half
+        std::unique_ptr<SidecarFile::MappedFile> level_0 = ok && level_sizes.size() > 1 ? SidecarFile::MappedFile::Open(temp_path) : nullptr;
+        ok &= level_sizes.size() <= 1 || level_0 != nullptr;
+        for (size_t i = 0; i < n_parameters && level_0 && ok; ++i)
+        {
+            const double *data = level_0->At<double>(records[i].data_offset);
+            std::vector<double> level_min(data, data + n_buckets);
+            std::vector<double> level_max(data + n_buckets, data + 2 * n_buckets);
+            std::vector<double> level_mean(data + 2 * n_buckets, data + 3 * n_buckets);
+            std::vector<double> level_count(data + 3 * n_buckets, data + 4 * n_buckets);
+
+            uint64_t position = records[i].data_offset + 4 * n_buckets * sizeof(double);
+            for (size_t level = 0; level + 1 < level_sizes.size(); ++level)
+            {
+                const size_t n_next = level_sizes[level + 1];
+                std::vector<double> next_min(n_next), next_max(n_next), next_mean(n_next), next_count(n_next);
+                for (size_t bucket = 0; bucket < n_next; ++bucket)
+                {
+                    const size_t left = 2 * bucket;
+                    const size_t right = std::min(left + 1, level_min.size() - 1);
+                    next_min[bucket] = std::min(level_min[left], level_min[right]);
+                    next_max[bucket] = std::max(level_max[left], level_max[right]);
+                    next_count[bucket] = right == left ? level_count[left] : level_count[left] + level_count[right];
+                    next_mean[bucket] = right == left || next_count[bucket] == 0 ? level_mean[left] : (level_mean[left] * level_count[left] + level_mean[right] * level_count[right]) / next_count[bucket];
+                }
+
+                write_at(next_min.data(), n_next * sizeof(double), position);
+                write_at(next_max.data(), n_next * sizeof(double), position + n_next * sizeof(double));
+                write_at(next_mean.data(), n_next * sizeof(double), position + 2 * n_next * sizeof(double));
+                write_at(next_count.data(), n_next * sizeof(double), position + 3 * n_next * sizeof(double));
+                position += 4 * n_next * sizeof(double);
+
+                level_min = std::move(next_min);
+                level_max = std::move(next_max);
+                level_mean = std::move(next_mean);
+                level_count = std::move(next_count);
+            }
+        }
+        level_0.reset();
+        ok &= close(fd) == 0;
+
+        if (!ok || std::rename(temp_path.c_str(), output_path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Could not write trace pyramid: " + output_path);
+        }
+    }
+
+    // Reading
+    class PyramidFile
+    {
+    public:
+        // Returns nullptr if the file is missing or isn't a valid pyramid
+        static std::unique_ptr<PyramidFile> Open(const std::string &path)
+        {
+            auto file = SidecarFile::MappedFile::Open(path);
+            if (!file || file->GetSize() < sizeof(FileHeader))
+                return nullptr;
+
+            std::unique_ptr<PyramidFile> pyramid(new PyramidFile(std::move(file)));
+            if (!pyramid->IsValid())
+                return nullptr;
+
+            return pyramid;
+        }
+
+        const FileHeader &GetHeader() const { return *file_->At<FileHeader>(0); }
+        size_t GetNParameters() const { return GetHeader().n_parameters; }
+
+        std::string GetName(size_t i) const
+        {
+            const ParameterRecord &record = GetRecord(i);
+            return std::string(file_->At<char>(record.name_offset), record.name_length);
+        }
+
+        // -1 if the parameter isn't in the pyramid
+        int Find(const std::string &name) const
+        {
+            auto it = index_.find(name);
+            return it == index_.end() ? -1 : it->second;
+        }
+
+        bool Matches(const SidecarFile::SourceIdentity &identity, uint32_t block_size) const
+        {
+            const FileHeader &header = GetHeader();
+            return header.source_size == identity.size &&
+                   header.source_mtime == identity.mtime &&
+                   header.block_size == block_size;
+        }
+
+        int64_t GetFirstStep() const { return GetHeader().n_entries ? FirstSteps()[0] : 0; }
+        int64_t GetLastStep() const { return GetHeader().n_entries ? LastSteps()[level_sizes_[0] - 1] : 0; }
+
+        // At most n_points buckets covering [step_lo, step_hi], from the finest level that fits. Buckets where
+        // every entry was cut are left out
+        TraceSlice Query(size_t parameter, int64_t step_lo, int64_t step_hi, size_t n_points) const
+        {
+            TraceSlice slice;
+            if (level_sizes_.empty() || n_points == 0 || step_hi < step_lo)
+                return slice;
+
+            const uint64_t n_buckets = level_sizes_[0];
+            const int64_t *first_steps = FirstSteps();
+            const int64_t *last_steps = LastSteps();
+
+            // Steps only ever increase so the window edges can be binary searched
+            const uint64_t first = std::lower_bound(last_steps, last_steps + n_buckets, step_lo) - last_steps;
+            const uint64_t last = std::upper_bound(first_steps, first_steps + n_buckets, step_hi) - first_steps;
+            if (first >= last)
+                return slice;
+
+            size_t level = 0;
+            while (level + 1 < level_sizes_.size() && ((last - 1) >> level) - (first >> level) + 1 > n_points)
+            {
+                ++level;
+            }
+
+            const uint64_t level_first = first >> level;
+            const uint64_t level_last = (last - 1) >> level;
+            const uint64_t n_level = level_sizes_[level];
+            const double *level_min = file_->At<double>(GetRecord(parameter).data_offset) + 4 * level_offsets_[level];
+            const double *level_max = level_min + n_level;
+            const double *level_mean = level_max + n_level;
+            const double *level_count = level_mean + n_level;
+
+            for (uint64_t bucket = level_first; bucket <= level_last; ++bucket)
+            {
+                if (level_count[bucket] == 0)
+                    continue;
+                const uint64_t base_first = bucket << level;
+                const uint64_t base_last = std::min(((bucket + 1) << level) - 1, n_buckets - 1);
+                slice.step.push_back(0.5 * double(first_steps[base_first] + last_steps[base_last]));
+                slice.min.push_back(level_min[bucket]);
+                slice.max.push_back(level_max[bucket]);
+                slice.mean.push_back(level_mean[bucket]);
+            }
+            return slice;
+        }
+
+    private:
+        PyramidFile(std::unique_ptr<SidecarFile::MappedFile> file) : file_(std::move(file)) {}
+
+        const ParameterRecord &GetRecord(size_t i) const
+        {
+            return file_->At<ParameterRecord>(GetHeader().records_offset)[i];
+        }
+
+        const int64_t *FirstSteps() const { return file_->At<int64_t>(GetHeader().steps_offset); }
+        const int64_t *LastSteps() const { return FirstSteps() + level_sizes_[0]; }
+
+        bool IsValid()
+        {
+            const FileHeader &header = GetHeader();
+            const size_t file_size = file_->GetSize();
+            if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion || header.block_size == 0)
+                return false;
+
+            level_sizes_ = GetLevelSizes(header.n_entries, header.block_size);
+            if (level_sizes_.size() != header.n_levels)
+                return false;
+
+            uint64_t values_per_parameter = 0;
+            for (uint64_t size : level_sizes_)
+            {
+                level_offsets_.push_back(values_per_parameter / 4);
+                values_per_parameter += 4 * size;
+            }
+
+            const uint64_t n_buckets = level_sizes_.empty() ? 0 : level_sizes_[0];
+            if (header.records_offset + uint64_t(header.n_parameters) * sizeof(ParameterRecord) > file_size ||
+                header.steps_offset + 2 * n_buckets * sizeof(int64_t) > file_size)
+                return false;
+
+            for (size_t i = 0; i < header.n_parameters; ++i)
+            {
+                const ParameterRecord &record = GetRecord(i);
+                if (record.name_offset + record.name_length > file_size ||
+                    record.data_offset + values_per_parameter * sizeof(double) > file_size)
+                    return false;
+                index_[GetName(i)] = i;
+            }
+            return true;
+        }
+
+        std::unique_ptr<SidecarFile::MappedFile> file_;
+        std::vector<uint64_t> level_sizes_;
+        std::vector<uint64_t> level_offsets_; // Start of each level in units of 4 arrays
+        std::unordered_map<std::string, int> index_;
+    };
+
+    // Main interface, maps the pyramid if it's still valid and builds it otherwise
+    inline std::unique_ptr<PyramidFile> LoadOrBuild(const TString &chain_file, uint32_t block_size = 128)
+    {
+        SidecarFile::SourceIdentity identity;
+        if (!SidecarFile::GetSourceIdentity(chain_file.Data(), identity))
+        {
+            throw std::runtime_error("Could not find file: " + std::string(chain_file.Data()));
+        }
+
+        const std::string pyramid_path = SidecarFile::GetSidecarPath(identity, ".trace_lod");
+        auto pyramid = PyramidFile::Open(pyramid_path);
+        if (pyramid && pyramid->Matches(identity, block_size))
+        {
+            return pyramid;
+        }
+
+        std::cout << "Building trace pyramid for " << chain_file << std::endl;
+        {
+            std::unique_ptr<TFile> file(TFile::Open(chain_file));
+            if (!file || file->IsZombie())
+            {
+                throw std::runtime_error("Could not open file: " + std::string(chain_file.Data()));
+            }
+
+            TTree *posteriors = nullptr;
+            file->GetObject("posteriors", posteriors);
+            if (!posteriors)
+            {
+                throw std::runtime_error("posteriors tree not found in file: " + std::string(chain_file.Data()));
+            }
+            BuildPyramid(posteriors, identity, pyramid_path, block_size);
+        }
+
+        pyramid = PyramidFile::Open(pyramid_path);
+        if (!pyramid)
+        {
+            throw std::runtime_error("Could not read back trace pyramid: " + pyramid_path);
+        }
+        return pyramid;
+    }
+
+} // namespace TracePyramid